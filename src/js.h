@@ -4,25 +4,75 @@
 #include "types.h"
 
 // Key codes
+#define JS_KEY_CODE_ENTER 13
+#define JS_KEY_CODE_ESCAPE 27
 #define JS_KEY_CODE_SPACE 32
+#define JS_KEY_CODE_LEFT 37
+#define JS_KEY_CODE_UP 38
+#define JS_KEY_CODE_RIGHT 39
+#define JS_KEY_CODE_DOWN 40
+#define JS_KEY_CODE_O 79
+#define JS_KEY_CODE_P 80
+#define JS_KEY_CODE_BACKQUOTE 192
 
 // Exported functions
 void js_on_startup(void);
 void js_on_frame(void);
 
-void js_on_keyboard_event(s32 ascii_code, s32 new_state);
+void js_on_keyboard_event(s32 key_code, s32 new_state, f64 time_ms); // time_ms uses the same clock as js_get_time_ms
 void *js_on_image_loaded(s32 id, s32 width, s32 height);
+void js_on_image_ready(s32 id); // Call once the pixels have been copied into the image, before it counts as loaded.
+f64 js_get_level_load_time_ms(s32 level_idx); // Duration of the last load of a level, for profiling.
+
+// Replays. The last finished play session is available as a binary log. Logs copied into the playback
+// buffer can be re-simulated headlessly; js_replay_verify returns 1 if the outcome and tick of the end
+// match the log, 0 if they differ and -1 if the log is invalid. Verifying doesn't affect the game.
+u8 *js_replay_get_recording(void);
+s32 js_replay_get_recording_size(void);
+u8 *js_replay_get_playback_buffer(void);
+s32 js_replay_verify(s32 size);
+
+// Level solver. Searches every way through a level as loaded with the given seed. Returns 1 if the level
+// can be beaten, 0 if not and -1 if the level couldn't be loaded. The getters describe the last solve;
+// the reaction window is the shortest time the player is ever given to make a necessary move.
+s32 js_solve_level(s32 level_idx, u32 rng_seed);
+f64 js_solver_get_winning_path_count(void);
+f64 js_solver_get_reaction_window_ms(void);
+f64 js_solver_get_solve_time_ms(void);
+
+// Frame profiler. The backquote key toggles an overlay with the average time of each stage. Exports
+// return a NULL-terminated string of the recent per-frame stage times in microseconds. Format 0 is
+// JSON and 1 is CSV.
+char *js_profiler_export(s32 format);
+s32 js_profiler_get_export_length(void);
+
+// Session telemetry: a frame time histogram, frames over budget, frames with more than one tick due and
+// drift between the ticks and the music. A summary is saved to local storage when a level ends and when
+// the page is hidden, and the export returns this session and the last one as a NULL-terminated JSON string.
+void js_on_page_hide(void);
+char *js_telemetry_export(void);
+s32 js_telemetry_get_export_length(void);
+
+// Renderer counters for the last frame: calls, clipped calls and pixels copied, blended and skipped by
+// each video_* function, and how many pixels were written 0 to 5 or more times. Returns a
+// NULL-terminated JSON string, or "null" unless the game was built with VIDEO_COUNT_STATS on.
+char *js_render_stats_export(void);
+s32 js_render_stats_get_export_length(void);
+
+// Fast-forwards the level being played by a number of ticks. Returns the resulting PlayResult.
+s32 js_simulate_ticks(s32 tick_count);
 
 // Imported functions
 extern void js_print(const char* msg);
 extern void js_print_number(s32 number);
 extern void js_show_alert(const char* msg);
 
-extern s32 js_get_time_ms(void);
+extern f64 js_get_time_ms(void); // Monotonic, with sub-millisecond resolution where the host allows it.
 extern u32 js_get_unix_time(void); // TODO: Use 64 bit inetegr when WASM standard is updated
 
 extern void js_canvas_resize(s32 w, s32 h, f32 scale);
-extern void js_set_framebuffer(void *address);
+extern void js_set_framebuffer(void *address); // RGBA pixels the size of the canvas, read in place when presenting.
+extern void js_present_rows(s32 first_row, s32 row_count); // Copies rows of the framebuffer to the screen. Rows that aren't presented keep what was there.
 
 extern void js_asset_load_image(const char *url, s32 id);
 extern s32 js_asset_load_audio(const char *url);
@@ -31,7 +81,8 @@ extern s32 js_asset_count_loaded(void);
 extern void js_audio_play(s32 id);
 extern void js_audio_pause(s32 id);
 extern void js_audio_stop(s32 id);
-extern s32 js_audio_get_time(s32 id);
+extern f64 js_audio_get_time(s32 id);
+extern void js_audio_set_time(s32 id, f64 time_ms);
 
 extern void js_localstore_set_s32(const char *key, s32 value);
 extern s32 js_localstore_get_s32(const char *key);
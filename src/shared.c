@@ -1,11 +1,7 @@
 #include "shared.h"
 #include "js.h"
 #include "sin_table.h"
-
-static s32 rng_seed;
-
-static char strbuf[512];
-static s32 strbuf_idx = 0;
+#include <stdarg.h>
 
 extern unsigned char __heap_base; // Defined by linker.
 
@@ -44,10 +40,18 @@ f32 math_abs_f32(f32 x)
     else return x;
 }
 
+f32 math_floor_f32(f32 x)
+{
+    // Floats this large have no fractional part (and may not fit in an s32).
+    if (x >= 8388608.f || x <= -8388608.f) return x;
+    
+    f32 truncated = (f32)(s32)x;
+    return truncated > x ? truncated - 1.f : truncated;
+}
+
 f32 math_mod_f32(f32 x, f32 y)
 {
-    while (x > y) x -= y;
-    return x;
+    return x - y * math_floor_f32(x / y);
 }
 
 s32 math_round_f32_to_s32(f32 x)
@@ -55,37 +59,54 @@ s32 math_round_f32_to_s32(f32 x)
     return (s32)(x + .5f);
 }
 
+// Looks up a fraction of a full turn (any value) in the sine table with linear interpolation.
+static f32 math_sin_turns(f32 turns)
+{
+    turns -= math_floor_f32(turns);
+    
+    f32 pos = turns * (f32)MATH_SIN_TABLE_SIZE;
+    s32 idx = (s32)pos;
+    if (idx >= MATH_SIN_TABLE_SIZE) idx = MATH_SIN_TABLE_SIZE - 1; // Guard against rounding up to 1.0.
+    f32 frac = pos - (f32)idx;
+    
+    return math_sin_table[idx] + (math_sin_table[idx + 1] - math_sin_table[idx]) * frac;
+}
+
 f32 math_sin(f32 x)
 {
-    const f32 pi2 = 3.141592f * 2.f;
-    while (x < 0.f) x += pi2;
-    x = math_mod_f32(x, pi2);
-    s32 idx = (x * (f32)countof(math_sin_table)) / pi2;
-    if (idx < 0) idx = 0;
-    if (idx >= countof(math_sin_table)) idx = countof(math_sin_table) - 1;
-    return math_sin_table[idx];
+    return math_sin_turns(x * (1.f / MATH_TAU));
+}
+
+f32 math_cos(f32 x)
+{
+    return math_sin_turns(x * (1.f / MATH_TAU) + .25f);
+}
+
+void rng_set_seed(struct Rng *rng, u32 seed)
+{
+    rng->seed = seed;
 }
 
-void rng_set_seed(u32 seed)
+u32 rng_get_seed(struct Rng *rng)
 {
-    rng_seed = seed;
+    return rng->seed;
 }
 
-u32 rng_get_u32()
+u32 rng_get_u32(struct Rng *rng)
 {
     // xor algorithm from p. 4 of Marsaglia, "Xorshift RNGs".
-    u32 x = rng_seed;
+    u32 x = rng->seed;
 	x ^= x << 13;
 	x ^= x >> 17;
 	x ^= x << 5;
-    rng_seed = x;
+    rng->seed = x;
 	return x;
 }
 
-u32 rng_get_u32_range(u32 min_inclusive, u32 max_inclusive)
+u32 rng_get_u32_range(struct Rng *rng, u32 min_inclusive, u32 max_inclusive)
 {
     u32 range = max_inclusive - min_inclusive;
-    return min_inclusive + (rng_get_u32() % (range + 1));
+    return min_inclusive + (rng_get_u32(rng) % (range + 1));
 }
 
 void mem_copy(void *destination, void *source, s32 bytes)
@@ -140,6 +161,21 @@ void *mem_alloc(s32 bytes)
     return (void *)heap_top_before;
 }
 
+void mem_write_u32_le(void *destination, u32 value)
+{
+    u8 *dest = (u8 *)destination;
+    dest[0] = (u8)value;
+    dest[1] = (u8)(value >> 8);
+    dest[2] = (u8)(value >> 16);
+    dest[3] = (u8)(value >> 24);
+}
+
+u32 mem_read_u32_le(void *source)
+{
+    u8 *src = (u8 *)source;
+    return (u32)src[0] | ((u32)src[1] << 8) | ((u32)src[2] << 16) | ((u32)src[3] << 24);
+}
+
 s32 str_count_length(const char *str)
 {
     ASSERT(str != NULL);
@@ -153,110 +189,308 @@ s32 str_count_length(const char *str)
     return len;
 }
 
-bool str_s32_to_str(const char *str, s32 max_length, s32 number)
+s32 str_format_s32(char *dest, s32 capacity, s32 number)
 {
-    ASSERT(str != NULL);
-    ASSERT(max_length > 0);
-    // TODO: Handle INT_MIN case
+    ASSERT(dest != NULL);
+    ASSERT(capacity > 0);
     
-    bool is_negative = false;
+    static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
     
-    if (number < 0)
+    // Work with the magnitude as a u32 so that INT_MIN can be negated.
+    bool is_negative = number < 0;
+    u32 magnitude = is_negative ? (u32)0 - (u32)number : (u32)number;
+    
+    char buffer[11]; // "-2147483648"
+    s32 i = countof(buffer);
+    
+    // Emit two digits at a time, starting from the least significant.
+    while (magnitude >= 100)
+    {
+        u32 pair = (magnitude % 100) * 2;
+        magnitude /= 100;
+        buffer[--i] = digit_pairs[pair + 1];
+        buffer[--i] = digit_pairs[pair];
+    }
+    if (magnitude >= 10)
     {
-        is_negative = true;
-        number = -number; // NOTE: Won't work with INT_MIN?
+        u32 pair = magnitude * 2;
+        buffer[--i] = digit_pairs[pair + 1];
+        buffer[--i] = digit_pairs[pair];
     }
+    else
+    {
+        buffer[--i] = (char)('0' + magnitude);
+    }
+    if (is_negative) buffer[--i] = '-';
+    
+    s32 len = countof(buffer) - i;
+    if (len + 1 > capacity) return -1; // Not enough space
     
-    char buffer[128];
-    mem_set_u8(buffer, 128, 0);
-    s32 i = 126; // TODO: Replace with ARRAY_LEN(buffer)
-    s32 count = 1; // NULL-terminator
+    mem_copy(dest, &buffer[i], len);
+    dest[len] = '\0';
+    return len;
+}
+
+void strbuf_init(struct StrBuf *buf, char *storage, s32 capacity)
+{
+    ASSERT(buf != NULL);
+    ASSERT(storage != NULL);
+    ASSERT(capacity > 0);
     
-    if (number == 0)
+    buf->data = storage;
+    buf->capacity = capacity;
+    strbuf_clear(buf);
+}
+
+void strbuf_clear(struct StrBuf *buf)
+{
+    buf->length = 0;
+    buf->has_overflowed = false;
+    buf->data[0] = '\0';
+}
+
+// Appends up to len bytes, truncating when the buffer is full.
+static void strbuf_push_bytes(struct StrBuf *buf, const char *bytes, s32 len)
+{
+    s32 space = buf->capacity - 1 - buf->length;
+    if (len > space)
     {
-        buffer[i] = '0';
-        i -= 1;
-        count += 1;
+        len = space;
+        buf->has_overflowed = true;
     }
-    else
+    
+    mem_copy(&buf->data[buf->length], (void *)bytes, len);
+    buf->length += len;
+    buf->data[buf->length] = '\0';
+}
+
+void strbuf_push_string(struct StrBuf *buf, const char *str)
+{
+    ASSERT(str != NULL);
+    
+    strbuf_push_bytes(buf, str, str_count_length(str));
+}
+
+void strbuf_push_s32(struct StrBuf *buf, s32 num)
+{
+    char digits[12];
+    s32 len = str_format_s32(digits, countof(digits), num);
+    strbuf_push_bytes(buf, digits, len);
+}
+
+void strbuf_push_char(struct StrBuf *buf, char c)
+{
+    strbuf_push_bytes(buf, &c, 1);
+}
+
+void strbuf_printf(struct StrBuf *buf, const char *format, ...)
+{
+    ASSERT(format != NULL);
+    
+    va_list args;
+    va_start(args, format);
+    
+    const char *literal_start = format;
+    const char *c = format;
+    while (*c != '\0')
     {
-        while (number != 0)
+        if (*c != '%')
         {
-            buffer[i] = '0' + (number % 10);
-            number /= 10;
-            i -= 1;
-            count += 1;
+            c += 1;
+            continue;
         }
         
-        if (is_negative)
+        strbuf_push_bytes(buf, literal_start, (s32)(c - literal_start));
+        c += 1;
+        
+        switch (*c)
         {
-            buffer[i] = '-';
-            i -= 1;
-            count += 1;
+            case 'd': strbuf_push_s32(buf, va_arg(args, s32)); break;
+            case 's': strbuf_push_string(buf, va_arg(args, const char *)); break;
+            case 'c': strbuf_push_char(buf, (char)va_arg(args, s32)); break;
+            case '%': strbuf_push_char(buf, '%'); break;
+            default: ASSERT(false); // Unsupported format specifier.
         }
+        
+        if (*c != '\0') c += 1;
+        literal_start = c;
     }
+    strbuf_push_bytes(buf, literal_start, (s32)(c - literal_start));
     
-    if (count > max_length) return false; // Not enough space
+    va_end(args);
+}
+
+char *strbuf_get(struct StrBuf *buf)
+{
+    return buf->data;
+}
+
+bool input_queue_push(struct InputQueue *queue, struct InputEvent event)
+{
+    ASSERT(queue != NULL);
     
-    mem_copy((void *)str, &buffer[i + 1], count);
+    if (queue->write_idx - queue->read_idx == INPUT_QUEUE_CAPACITY)
+    {
+        queue->dropped_count += 1;
+        return false;
+    }
     
+    queue->events[queue->write_idx % INPUT_QUEUE_CAPACITY] = event;
+    queue->write_idx += 1;
     return true;
 }
 
-void strbuf_clear(void)
+bool input_queue_pop(struct InputQueue *queue, struct InputEvent *event)
 {
-    strbuf_idx = 0;
+    ASSERT(queue != NULL);
+    ASSERT(event != NULL);
+    
+    if (queue->read_idx == queue->write_idx) return false;
     
-    // TODO: Shouldn't need to mem set to 0 here. Find out what is going wrong...
-    mem_set_u8((void *)strbuf, countof(strbuf), 0);
+    *event = queue->events[queue->read_idx % INPUT_QUEUE_CAPACITY];
+    queue->read_idx += 1;
+    return true;
 }
 
-void strbuf_push_string(const char *str)
+void input_begin_frame(struct InputState *input, struct InputQueue *queue)
 {
-    ASSERT(str != NULL);
+    ASSERT(input != NULL);
+    ASSERT(queue != NULL);
     
-    s32 str_len = str_count_length(str);
+    for (s32 i = 0; i < input->pressed_keys_count; ++i) input->press_count[input->pressed_keys[i]] = 0;
+    input->pressed_keys_count = 0;
+    input->any_press_count = 0;
+    input->frame_event_count = 0;
     
-    ASSERT(strbuf_idx + str_len + 1 < countof(strbuf)); // TODO: Make this a regular error check?
+    struct InputEvent event;
+    while (input_queue_pop(queue, &event))
+    {
+        // Ignore auto-repeated presses of a key that is already held.
+        if (event.is_down && input->is_down[event.key]) continue;
+        
+        input->is_down[event.key] = event.is_down;
+        input->frame_events[input->frame_event_count++] = event;
+        
+        if (event.is_down)
+        {
+            if (input->press_count[event.key] == 0) input->pressed_keys[input->pressed_keys_count++] = event.key;
+            input->press_count[event.key] += 1;
+            input->last_press_time_ms[event.key] = event.time_ms;
+            input->any_press_count += 1;
+        }
+    }
+}
+
+bool input_is_down(struct InputState *input, s32 key)
+{
+    ASSERT(key >= 0 && key < INPUT_KEY_COUNT);
     
-    mem_copy((void*)(&strbuf[strbuf_idx]), (void*)str, str_len + 1);
-    strbuf_idx += str_len; // Set strbuf_idx to be at the NULL-terminator.
+    return input->is_down[key];
 }
 
-void strbuf_push_s32(s32 num)
+bool input_was_pressed(struct InputState *input, s32 key)
 {
-    s32 len_before = str_count_length(strbuf);
-    str_s32_to_str((const char *)(&strbuf[strbuf_idx]), countof(strbuf) - strbuf_idx - 1, num);
-    s32 len_after = str_count_length(strbuf);
-    strbuf_idx += len_after - len_before;
+    ASSERT(key >= 0 && key < INPUT_KEY_COUNT);
+    
+    return input->press_count[key] > 0;
 }
 
-void strbuf_push_char(u8 c)
+bool input_any_was_pressed(struct InputState *input)
 {
-    strbuf[strbuf_idx++] = c;
-    strbuf[strbuf_idx++] = '\0';
+    return input->any_press_count > 0;
 }
 
-char *strbuf_get(void)
+s32 image_get_bytes_per_pixel(struct Image *image)
 {
-    return strbuf;
+    ASSERT(image != NULL);
+    
+    if (image->format == IMAGE_FORMAT_INDEXED) return 1;
+    return 4; // HTML5 images are always in RGBA (32 bit) format.
 }
 
 s32 image_calculate_size(struct Image *image)
 {
     ASSERT(image != NULL);
     
-    return image->width * image->height * 4; // HTML5 images are always in RGBA (32 bit) format.
+    return image->width * image->height * image_get_bytes_per_pixel(image);
+}
+
+void image_premultiply_alpha(struct Image *image)
+{
+    ASSERT(image != NULL);
+    ASSERT(image->data != NULL);
+    
+    bool is_opaque = true;
+    bool is_binary = true;
+    
+    u8 *pixels = (u8 *)image->data;
+    for (s32 i = 0; i < image_calculate_size(image); i += 4)
+    {
+        u32 alpha = pixels[i + 3];
+        if (alpha != 255) is_opaque = false;
+        if (alpha != 0 && alpha != 255) is_binary = false;
+        
+        pixels[i + 0] = (u8)((pixels[i + 0] * alpha) / 255);
+        pixels[i + 1] = (u8)((pixels[i + 1] * alpha) / 255);
+        pixels[i + 2] = (u8)((pixels[i + 2] * alpha) / 255);
+    }
+    
+    image->alpha = IMAGE_ALPHA_BLENDED;
+    if (is_binary) image->alpha = IMAGE_ALPHA_BINARY;
+    if (is_opaque) image->alpha = IMAGE_ALPHA_OPAQUE;
 }
 
-static u8 video_blend_component(u8 a, u8 b, float percent_b)
+void image_convert_to_indexed(struct Image *image, struct VideoPalette *palette)
 {
-    // TODO: Change this function to blend 2 colors instead of individual components
+    ASSERT(image != NULL);
+    ASSERT(image->data != NULL);
+    ASSERT(image->format == IMAGE_FORMAT_RGBA);
+    ASSERT(palette != NULL);
     
-    ASSERT(percent_b <= 1.f);
+    // Each index is written over bytes of pixels that have already been read.
+    u8 *pixels = (u8 *)image->data;
+    u8 *indices = (u8 *)image->data;
+    bool is_opaque = true;
+    for (s32 i = 0; i < image->width * image->height; ++i)
+    {
+        u8 *pixel = &pixels[i * 4];
+        u32 alpha = pixel[3];
+        if (alpha != 255) is_opaque = false;
+        
+        u8 index = VIDEO_PALETTE_TRANSPARENT;
+        if (alpha >= 128)
+        {
+            // Indexed pixels don't blend, so undo the premultiplication.
+            struct Color color = {
+                (u8)((pixel[0] * 255) / alpha),
+                (u8)((pixel[1] * 255) / alpha),
+                (u8)((pixel[2] * 255) / alpha),
+                255,
+            };
+            index = video_palette_get_index(palette, color);
+        }
+        indices[i] = index;
+    }
     
-    float percent_a = 1.f - percent_b;
-    return (u8)(((float)a * percent_a) + ((float)b * percent_b));
+    image->format = IMAGE_FORMAT_INDEXED;
+    image->palette = palette;
+    image->alpha = is_opaque ? IMAGE_ALPHA_OPAQUE : IMAGE_ALPHA_BINARY;
+}
+
+// The source component has already been multiplied by its alpha, so blending is a single multiply-add.
+static u8 video_blend_premultiplied(u8 dest, u8 src, u32 inverse_alpha)
+{
+    return (u8)(src + (dest * inverse_alpha) / 255);
 }
 
 static u32 video_make_color_u32(struct Color color)
@@ -270,6 +504,303 @@ struct Color video_make_color(u8 r, u8 g, u8 b)
     return c;
 }
 
+void video_palette_init(struct VideoPalette *palette)
+{
+    mem_set_u8(palette, sizeof(*palette), 0);
+    palette->count = VIDEO_PALETTE_TRANSPARENT + 1;
+}
+
+static s32 video_color_distance_squared(u32 a, u32 b)
+{
+    s32 distance = 0;
+    for (s32 shift = 0; shift < 24; shift += 8)
+    {
+        s32 delta = (s32)((a >> shift) & 0xFF) - (s32)((b >> shift) & 0xFF);
+        distance += delta * delta;
+    }
+    return distance;
+}
+
+u8 video_palette_get_index(struct VideoPalette *palette, struct Color color)
+{
+    color.a = 255;
+    u32 color_u32 = video_make_color_u32(color);
+    
+    for (s32 i = VIDEO_PALETTE_TRANSPARENT + 1; i < palette->count; ++i)
+    {
+        if (palette->colors[i] == color_u32) return (u8)i;
+    }
+    
+    if (palette->count < VIDEO_PALETTE_SIZE)
+    {
+        palette->colors[palette->count] = color_u32;
+        return (u8)palette->count++;
+    }
+    
+    s32 closest = VIDEO_PALETTE_TRANSPARENT + 1;
+    s32 closest_distance = video_color_distance_squared(palette->colors[closest], color_u32);
+    for (s32 i = closest + 1; i < palette->count; ++i)
+    {
+        s32 distance = video_color_distance_squared(palette->colors[i], color_u32);
+        if (distance < closest_distance)
+        {
+            closest = i;
+            closest_distance = distance;
+        }
+    }
+    return (u8)closest;
+}
+
+static struct VideoPaletteRemap *video_palette_get_remap(struct VideoPalette *palette, struct Color color)
+{
+    u32 color_u32 = video_make_color_u32(color);
+    
+    struct VideoPaletteRemap *remap = NULL;
+    for (s32 i = 0; i < palette->remap_count; ++i)
+    {
+        if (palette->remaps[i].color == color_u32) remap = &palette->remaps[i];
+    }
+    
+    if (remap == NULL)
+    {
+        // Once there's no room left, keep rebuilding the last one.
+        if (palette->remap_count < VIDEO_MAX_PALETTE_REMAPS) palette->remap_count += 1;
+        remap = &palette->remaps[palette->remap_count - 1];
+        remap->color = color_u32;
+        remap->built_count = 0;
+    }
+    
+    // Blended colors are added to the palette, and then need remapping too.
+    u32 inverse_alpha = 255 - color.a;
+    u8 r = (u8)((color.r * color.a) / 255);
+    u8 g = (u8)((color.g * color.a) / 255);
+    u8 b = (u8)((color.b * color.a) / 255);
+    while (remap->built_count < palette->count)
+    {
+        s32 i = remap->built_count;
+        u8 *entry = (u8 *)&palette->colors[i];
+        
+        u8 index = VIDEO_PALETTE_TRANSPARENT;
+        if (i != VIDEO_PALETTE_TRANSPARENT)
+        {
+            struct Color blended = {
+                video_blend_premultiplied(entry[0], r, inverse_alpha),
+                video_blend_premultiplied(entry[1], g, inverse_alpha),
+                video_blend_premultiplied(entry[2], b, inverse_alpha),
+                255,
+            };
+            index = video_palette_get_index(palette, blended);
+        }
+        remap->indices[i] = index;
+        remap->built_count += 1;
+    }
+    
+    return remap;
+}
+
+void video_expand_indexed_rows(struct Image *dest, struct Image *indexed, s32 first_row, s32 row_count)
+{
+    ASSERT(dest != NULL);
+    ASSERT(dest->data != NULL);
+    ASSERT(dest->format == IMAGE_FORMAT_RGBA);
+    ASSERT(indexed != NULL);
+    ASSERT(indexed->data != NULL);
+    ASSERT(indexed->format == IMAGE_FORMAT_INDEXED);
+    ASSERT(dest->width == indexed->width && dest->height == indexed->height);
+    
+    u32 *colors = indexed->palette->colors;
+    u32 *out = (u32 *)dest->data + first_row * dest->width;
+    u8 *in = (u8 *)indexed->data + first_row * indexed->width;
+    for (s32 i = 0; i < row_count * indexed->width; ++i)
+    {
+        out[i] = colors[in[i]];
+    }
+}
+
+void video_dirty_rects_clear(struct VideoDirtyRects *dirty_rects)
+{
+    dirty_rects->count = 0;
+}
+
+static struct Rect video_rect_union(struct Rect a, struct Rect b)
+{
+    s32 x_start = math_min_s32(a.x, b.x);
+    s32 y_start = math_min_s32(a.y, b.y);
+    s32 x_end = math_max_s32(a.x + a.w, b.x + b.w);
+    s32 y_end = math_max_s32(a.y + a.h, b.y + b.h);
+    
+    struct Rect result = {x_start, y_start, x_end - x_start, y_end - y_start};
+    return result;
+}
+
+static bool video_rects_touch(struct Rect a, struct Rect b)
+{
+    return a.x <= b.x + b.w && b.x <= a.x + a.w &&
+           a.y <= b.y + b.h && b.y <= a.y + a.h;
+}
+
+void video_dirty_rects_add(struct VideoDirtyRects *dirty_rects, struct Rect rect)
+{
+    ASSERT(dirty_rects != NULL);
+    
+    if (rect.w <= 0 || rect.h <= 0) return;
+    
+    // Absorb every rect the new one touches. A merge can make it touch rects it didn't before, so start over after each one.
+    s32 i = 0;
+    while (i < dirty_rects->count)
+    {
+        if (!video_rects_touch(rect, dirty_rects->rects[i]))
+        {
+            i += 1;
+            continue;
+        }
+        
+        rect = video_rect_union(rect, dirty_rects->rects[i]);
+        dirty_rects->count -= 1;
+        dirty_rects->rects[i] = dirty_rects->rects[dirty_rects->count];
+        i = 0;
+    }
+    
+    if (dirty_rects->count < VIDEO_MAX_DIRTY_RECTS)
+    {
+        dirty_rects->rects[dirty_rects->count] = rect;
+        dirty_rects->count += 1;
+        return;
+    }
+    
+    // Out of room. Merge with the rect that grows the least.
+    s32 best_idx = 0;
+    s32 best_growth = 0;
+    for (i = 0; i < dirty_rects->count; ++i)
+    {
+        struct Rect existing = dirty_rects->rects[i];
+        struct Rect merged = video_rect_union(rect, existing);
+        s32 growth = (merged.w * merged.h) - (existing.w * existing.h);
+        if (i == 0 || growth < best_growth)
+        {
+            best_idx = i;
+            best_growth = growth;
+        }
+    }
+    dirty_rects->rects[best_idx] = video_rect_union(rect, dirty_rects->rects[best_idx]);
+}
+
+bool video_dirty_rects_get_row_range(struct VideoDirtyRects *dirty_rects, s32 *first_row, s32 *row_count)
+{
+    ASSERT(dirty_rects != NULL);
+    
+    if (dirty_rects->count == 0) return false;
+    
+    s32 row_start = dirty_rects->rects[0].y;
+    s32 row_end = dirty_rects->rects[0].y + dirty_rects->rects[0].h;
+    for (s32 i = 1; i < dirty_rects->count; ++i)
+    {
+        row_start = math_min_s32(row_start, dirty_rects->rects[i].y);
+        row_end = math_max_s32(row_end, dirty_rects->rects[i].y + dirty_rects->rects[i].h);
+    }
+    
+    *first_row = row_start;
+    *row_count = row_end - row_start;
+    return true;
+}
+
+// Records that an area of the framebuffer was drawn to, if the framebuffer is tracking that.
+static void video_mark_dirty(struct Image *framebuffer, s32 x, s32 y, s32 w, s32 h)
+{
+    if (framebuffer->dirty_rects == NULL) return;
+    
+    s32 x_start = math_max_s32(x, 0);
+    s32 y_start = math_max_s32(y, 0);
+    s32 x_end = math_min_s32(x + w, framebuffer->width);
+    s32 y_end = math_min_s32(y + h, framebuffer->height);
+    if (x_start >= x_end || y_start >= y_end) return;
+    
+    struct Rect rect = {x_start, y_start, x_end - x_start, y_end - y_start};
+    video_dirty_rects_add(framebuffer->dirty_rects, rect);
+}
+
+void video_stats_clear(struct VideoStats *stats, s32 pixel_count)
+{
+    mem_set_u8(stats->function, sizeof(stats->function), 0);
+    if (stats->overdraw != NULL) mem_set_u8(stats->overdraw, pixel_count, 0);
+}
+
+s32 video_stats_get_overdraw_level(u8 write_count)
+{
+    return math_min_s32(write_count, VIDEO_OVERDRAW_LEVELS - 1);
+}
+
+#if VIDEO_COUNT_STATS
+static void video_count_call(struct Image *framebuffer, enum VideoFunction function, bool is_clipped_away)
+{
+    if (framebuffer->stats == NULL) return;
+    
+    framebuffer->stats->function[function].call_count += 1;
+    if (is_clipped_away) framebuffer->stats->function[function].clipped_away_count += 1;
+}
+
+static void video_count_writes(struct Image *framebuffer, enum VideoFunction function, bool is_blended, s32 first_pixel_idx, s32 count)
+{
+    if (framebuffer->stats == NULL) return;
+    
+    struct VideoFunctionStats *function_stats = &framebuffer->stats->function[function];
+    if (is_blended) function_stats->pixels_blended += count;
+    else function_stats->pixels_copied += count;
+    
+    u8 *overdraw = framebuffer->stats->overdraw;
+    if (overdraw == NULL) return;
+    for (s32 i = first_pixel_idx; i < first_pixel_idx + count; ++i)
+    {
+        if (overdraw[i] < 255) overdraw[i] += 1;
+    }
+}
+
+static void video_count_skipped(struct Image *framebuffer, enum VideoFunction function, s32 count)
+{
+    if (framebuffer->stats == NULL) return;
+    
+    framebuffer->stats->function[function].pixels_skipped += count;
+}
+
+#define VIDEO_COUNT_CALL(framebuffer, function, is_clipped_away) video_count_call(framebuffer, function, is_clipped_away)
+#define VIDEO_COUNT_COPIED(framebuffer, function, first_pixel_idx, count) video_count_writes(framebuffer, function, false, first_pixel_idx, count)
+#define VIDEO_COUNT_BLENDED(framebuffer, function, first_pixel_idx, count) video_count_writes(framebuffer, function, true, first_pixel_idx, count)
+#define VIDEO_COUNT_SKIPPED(framebuffer, function, count) video_count_skipped(framebuffer, function, count)
+#else
+// The function is still referenced, since helpers that draw for several functions take it as a parameter.
+#define VIDEO_COUNT_CALL(framebuffer, function, is_clipped_away) ((void)(function))
+#define VIDEO_COUNT_COPIED(framebuffer, function, first_pixel_idx, count) ((void)(function))
+#define VIDEO_COUNT_BLENDED(framebuffer, function, first_pixel_idx, count) ((void)(function))
+#define VIDEO_COUNT_SKIPPED(framebuffer, function, count) ((void)(function))
+#endif
+
+void video_draw_overdraw_heatmap(struct Image *framebuffer)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(framebuffer->stats != NULL);
+    ASSERT(framebuffer->stats->overdraw != NULL);
+    
+    // Black for pixels that weren't drawn, then blue, green, yellow and orange, and red for the worst.
+    struct Color level_colors[VIDEO_OVERDRAW_LEVELS] = {
+        {0, 0, 0, 255},
+        {30, 60, 200, 255},
+        {40, 190, 70, 255},
+        {230, 220, 50, 255},
+        {240, 140, 30, 255},
+        {220, 40, 40, 255},
+    };
+    
+    u8 *overdraw = framebuffer->stats->overdraw;
+    for (s32 i = 0; i < framebuffer->width * framebuffer->height; ++i)
+    {
+        struct Color color = level_colors[video_stats_get_overdraw_level(overdraw[i])];
+        if (framebuffer->format == IMAGE_FORMAT_INDEXED) ((u8 *)framebuffer->data)[i] = video_palette_get_index(framebuffer->palette, color);
+        else ((u32 *)framebuffer->data)[i] = video_make_color_u32(color);
+    }
+    video_mark_dirty(framebuffer, 0, 0, framebuffer->width, framebuffer->height);
+}
+
 void video_clear_framebuffer(struct Image *framebuffer, struct Color color)
 {
     ASSERT(framebuffer != NULL);
@@ -277,8 +808,74 @@ void video_clear_framebuffer(struct Image *framebuffer, struct Color color)
     
     color.a = 255;
     
-    u32 color_u32 = video_make_color_u32(color);
-    mem_set_u32(framebuffer->data, framebuffer->width * framebuffer->height, color_u32);
+    if (framebuffer->format == IMAGE_FORMAT_INDEXED)
+    {
+        mem_set_u8(framebuffer->data, framebuffer->width * framebuffer->height, video_palette_get_index(framebuffer->palette, color));
+    }
+    else
+    {
+        mem_set_u32(framebuffer->data, framebuffer->width * framebuffer->height, video_make_color_u32(color));
+    }
+    video_mark_dirty(framebuffer, 0, 0, framebuffer->width, framebuffer->height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_CLEAR_FRAMEBUFFER, false);
+    VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_CLEAR_FRAMEBUFFER, 0, framebuffer->width * framebuffer->height);
+}
+
+void video_copy_image(struct Image *framebuffer, struct Image *image)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(image != NULL);
+    ASSERT(image->data != NULL);
+    ASSERT(image->width == framebuffer->width && image->height == framebuffer->height);
+    ASSERT(image->format == framebuffer->format);
+    
+    mem_copy(framebuffer->data, image->data, image_calculate_size(framebuffer));
+    video_mark_dirty(framebuffer, 0, 0, framebuffer->width, framebuffer->height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_COPY_IMAGE, false);
+    VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_COPY_IMAGE, 0, framebuffer->width * framebuffer->height);
+}
+
+// The pattern pixel at (offset_x, offset_y) ends up in the top-left corner. Each framebuffer row is
+// copied from a single pattern row, so a pattern at least as wide as the framebuffer takes at most
+// two copies per row.
+void video_fill_tiled(struct Image *framebuffer, struct Image *pattern, s32 offset_x, s32 offset_y)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(pattern != NULL);
+    ASSERT(pattern->data != NULL);
+    ASSERT(pattern->format == framebuffer->format);
+    
+    s32 bytes_per_pixel = image_get_bytes_per_pixel(framebuffer);
+    u8 *dest = (u8 *)framebuffer->data;
+    u8 *src = (u8 *)pattern->data;
+    
+    s32 start_x = ((offset_x % pattern->width) + pattern->width) % pattern->width;
+    s32 src_y = ((offset_y % pattern->height) + pattern->height) % pattern->height;
+    
+    for (s32 y = 0; y < framebuffer->height; ++y)
+    {
+        u8 *dest_row = dest + y * framebuffer->width * bytes_per_pixel;
+        u8 *src_row = src + src_y * pattern->width * bytes_per_pixel;
+        
+        s32 x = 0;
+        s32 src_x = start_x;
+        while (x < framebuffer->width)
+        {
+            s32 length = math_min_s32(pattern->width - src_x, framebuffer->width - x);
+            mem_copy(dest_row + x * bytes_per_pixel, src_row + src_x * bytes_per_pixel, length * bytes_per_pixel);
+            x += length;
+            src_x = 0;
+        }
+        
+        src_y += 1;
+        if (src_y == pattern->height) src_y = 0;
+    }
+    
+    video_mark_dirty(framebuffer, 0, 0, framebuffer->width, framebuffer->height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_FILL_TILED, false);
+    VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_FILL_TILED, 0, framebuffer->width * framebuffer->height);
 }
 
 void video_draw_rect(struct Image *framebuffer, s32 rect_x, s32 rect_y, s32 rect_w, s32 rect_h, struct Color color)
@@ -294,21 +891,198 @@ void video_draw_rect(struct Image *framebuffer, s32 rect_x, s32 rect_y, s32 rect
     s32 y_end = math_min_s32(rect_y + rect_h, framebuffer->height);
     s32 width = x_end - x_start;
     s32 height = y_end - y_start;
+    video_mark_dirty(framebuffer, x_start, y_start, width, height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_DRAW_RECT, width <= 0 || height <= 0);
+    
+    if (color.a == 0) return;
     
-    for (int y = y_start; y < y_end; ++y)
+    if (framebuffer->format == IMAGE_FORMAT_INDEXED)
     {
-        for (int x = x_start; x < x_end; ++x)
+        u8 color_index = 0;
+        struct VideoPaletteRemap *remap = NULL;
+        if (color.a == 255) color_index = video_palette_get_index(framebuffer->palette, color);
+        else remap = video_palette_get_remap(framebuffer->palette, color);
+        
+        for (s32 y = y_start; y < y_end; ++y)
         {
-            int idx = (y * framebuffer->width + x) * 4;
+            u8 *row = (u8 *)framebuffer->data + y * framebuffer->width;
+            
+            if (remap == NULL)
+            {
+                mem_set_u8(&row[x_start], width, color_index);
+                VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_DRAW_RECT, y * framebuffer->width + x_start, width);
+                continue;
+            }
             
-            // Alpha blend
-            u8 *framebuffer_components = (u8 *)framebuffer->data;
-            float percent = (float)color.a / 255.f;
-            framebuffer_components[idx + 0] = video_blend_component(framebuffer_components[idx + 0], color.r, percent);
-            framebuffer_components[idx + 1] = video_blend_component(framebuffer_components[idx + 1], color.g, percent);
-            framebuffer_components[idx + 2] = video_blend_component(framebuffer_components[idx + 2], color.b, percent);
-            framebuffer_components[idx + 3] = 255;
+            VIDEO_COUNT_BLENDED(framebuffer, VIDEO_FUNCTION_DRAW_RECT, y * framebuffer->width + x_start, width);
+            for (s32 x = x_start; x < x_end; ++x)
+            {
+                row[x] = remap->indices[row[x]];
+            }
+        }
+        return;
+    }
+    
+    // Premultiply the color once for the whole rect.
+    u32 inverse_alpha = 255 - color.a;
+    u8 r = (u8)((color.r * color.a) / 255);
+    u8 g = (u8)((color.g * color.a) / 255);
+    u8 b = (u8)((color.b * color.a) / 255);
+    u32 color_u32 = video_make_color_u32(color);
+    
+    u32 *fb = (u32 *)framebuffer->data;
+    for (s32 y = y_start; y < y_end; ++y)
+    {
+        u32 *row = &fb[y * framebuffer->width];
+        
+        if (color.a == 255)
+        {
+            mem_set_u32(&row[x_start], width, color_u32);
+            VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_DRAW_RECT, y * framebuffer->width + x_start, width);
+            continue;
+        }
+        
+        VIDEO_COUNT_BLENDED(framebuffer, VIDEO_FUNCTION_DRAW_RECT, y * framebuffer->width + x_start, width);
+        for (s32 x = x_start; x < x_end; ++x)
+        {
+            u8 *d = (u8 *)&row[x];
+            d[0] = video_blend_premultiplied(d[0], r, inverse_alpha);
+            d[1] = video_blend_premultiplied(d[1], g, inverse_alpha);
+            d[2] = video_blend_premultiplied(d[2], b, inverse_alpha);
+            d[3] = 255;
+        }
+    }
+}
+
+void video_color_lut_build(struct VideoColorLut *lut, struct Color color)
+{
+    ASSERT(lut != NULL);
+    
+    // The same as blending with video_draw_rect, so either gives the same pixels.
+    lut->color = color;
+    u32 inverse_alpha = 255 - color.a;
+    u8 premultiplied[3] = {
+        (u8)((color.r * color.a) / 255),
+        (u8)((color.g * color.a) / 255),
+        (u8)((color.b * color.a) / 255),
+    };
+    for (s32 channel = 0; channel < 3; ++channel)
+    {
+        for (s32 value = 0; value < 256; ++value)
+        {
+            lut->channels[channel][value] = video_blend_premultiplied((u8)value, premultiplied[channel], inverse_alpha);
+        }
+    }
+}
+
+void video_apply_color_lut(struct Image *framebuffer, struct VideoColorLut *lut)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(lut != NULL);
+    
+    s32 pixel_count = framebuffer->width * framebuffer->height;
+    video_mark_dirty(framebuffer, 0, 0, framebuffer->width, framebuffer->height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_APPLY_COLOR_LUT, false);
+    VIDEO_COUNT_BLENDED(framebuffer, VIDEO_FUNCTION_APPLY_COLOR_LUT, 0, pixel_count);
+    
+    // Indexed pixels are remapped to the palette entries closest to the blended colors instead.
+    if (framebuffer->format == IMAGE_FORMAT_INDEXED)
+    {
+        struct VideoPaletteRemap *remap = video_palette_get_remap(framebuffer->palette, lut->color);
+        u8 *indices = (u8 *)framebuffer->data;
+        for (s32 i = 0; i < pixel_count; ++i)
+        {
+            indices[i] = remap->indices[indices[i]];
         }
+        return;
+    }
+    
+    // The rows of the whole framebuffer are contiguous, so they're gone through as one run.
+    u8 *pixels = (u8 *)framebuffer->data;
+    u8 *r = lut->channels[0];
+    u8 *g = lut->channels[1];
+    u8 *b = lut->channels[2];
+    for (s32 i = 0; i < pixel_count * 4; i += 4)
+    {
+        pixels[i + 0] = r[pixels[i + 0]];
+        pixels[i + 1] = g[pixels[i + 1]];
+        pixels[i + 2] = b[pixels[i + 2]];
+    }
+}
+
+// Draws pixels x_first to x_last of a row that starts at src_row_pixel_idx in the image and at
+// dest_row_pixel_idx in the framebuffer. A flipped row of the given width is read from its end.
+static void video_draw_row(struct Image *framebuffer, struct Image *image, enum VideoFunction function, s32 dest_row_pixel_idx, s32 src_row_pixel_idx, s32 x_first, s32 x_last, s32 width, bool is_flipped)
+{
+    if (framebuffer->format == IMAGE_FORMAT_INDEXED)
+    {
+        u8 *src_indices = (u8 *)image->data + src_row_pixel_idx;
+        u8 *dest_indices = (u8 *)framebuffer->data + dest_row_pixel_idx;
+        
+        if (image->alpha == IMAGE_ALPHA_OPAQUE && !is_flipped)
+        {
+            mem_copy(&dest_indices[x_first], &src_indices[x_first], x_last - x_first);
+            VIDEO_COUNT_COPIED(framebuffer, function, dest_row_pixel_idx + x_first, x_last - x_first);
+            return;
+        }
+        
+        for (s32 x = x_first; x < x_last; ++x)
+        {
+            s32 img_x = x;
+            if (is_flipped) img_x = width - 1 - x;
+            u8 index = src_indices[img_x];
+            
+            if (index == VIDEO_PALETTE_TRANSPARENT)
+            {
+                VIDEO_COUNT_SKIPPED(framebuffer, function, 1);
+                continue;
+            }
+            
+            dest_indices[x] = index;
+            VIDEO_COUNT_COPIED(framebuffer, function, dest_row_pixel_idx + x, 1);
+        }
+        return;
+    }
+    
+    u32 *src_row = (u32 *)image->data + src_row_pixel_idx;
+    u32 *dest_row = (u32 *)framebuffer->data + dest_row_pixel_idx;
+    
+    if (image->alpha == IMAGE_ALPHA_OPAQUE && !is_flipped)
+    {
+        mem_copy(&dest_row[x_first], &src_row[x_first], (x_last - x_first) * 4);
+        VIDEO_COUNT_COPIED(framebuffer, function, dest_row_pixel_idx + x_first, x_last - x_first);
+        return;
+    }
+    
+    for (s32 x = x_first; x < x_last; ++x)
+    {
+        s32 img_x = x;
+        if (is_flipped) img_x = width - 1 - x;
+        u32 src = src_row[img_x];
+        u32 src_a = src >> 24;
+        
+        if (src_a == 0)
+        {
+            VIDEO_COUNT_SKIPPED(framebuffer, function, 1);
+            continue;
+        }
+        
+        if (src_a == 255 || image->alpha != IMAGE_ALPHA_BLENDED)
+        {
+            dest_row[x] = src;
+            VIDEO_COUNT_COPIED(framebuffer, function, dest_row_pixel_idx + x, 1);
+            continue;
+        }
+        
+        u8 *d = (u8 *)&dest_row[x];
+        u8 *s = (u8 *)&src;
+        u32 inverse_alpha = 255 - src_a;
+        d[0] = video_blend_premultiplied(d[0], s[0], inverse_alpha);
+        d[1] = video_blend_premultiplied(d[1], s[1], inverse_alpha);
+        d[2] = video_blend_premultiplied(d[2], s[2], inverse_alpha);
+        d[3] = 255;
+        VIDEO_COUNT_BLENDED(framebuffer, function, dest_row_pixel_idx + x, 1);
     }
 }
 
@@ -318,9 +1092,7 @@ void video_blit(struct Image *framebuffer, struct Image *image, s32 dest_x, s32
     ASSERT(framebuffer->data != NULL);
     ASSERT(image != NULL);
     ASSERT(image->data != NULL);
-    
-    u8 *img = (u8 *)image->data;
-    u8 *dest = (u8 *)framebuffer->data;
+    ASSERT(image->format == framebuffer->format);
     
     s32 x_start = dest_x;
     s32 y_start = dest_y;
@@ -328,40 +1100,88 @@ void video_blit(struct Image *framebuffer, struct Image *image, s32 dest_x, s32
     s32 y_end = dest_y + sub_rect_h;
     s32 image_width = x_end - x_start;
     s32 image_height = y_end - y_start;
+    video_mark_dirty(framebuffer, x_start, y_start, image_width, image_height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_BLIT,
+        x_end <= 0 || y_end <= 0 || x_start >= framebuffer->width || y_start >= framebuffer->height);
     
-    for (s32 y = 0; y < image_height; ++y)
+    // The part of the sub rect that lands inside the framebuffer.
+    s32 x_first = math_max_s32(0, -x_start);
+    s32 y_first = math_max_s32(0, -y_start);
+    s32 x_last = math_min_s32(image_width, framebuffer->width - x_start);
+    s32 y_last = math_min_s32(image_height, framebuffer->height - y_start);
+    VIDEO_COUNT_SKIPPED(framebuffer, VIDEO_FUNCTION_BLIT,
+        image_width * image_height - math_max_s32(x_last - x_first, 0) * math_max_s32(y_last - y_first, 0));
+    
+    for (s32 y = y_first; y < y_last; ++y)
+    {
+        s32 img_y = y;
+        if (flip & BLIT_FLIP_VER) img_y = image_height - 1 - y;
+        s32 src_row_pixel_idx = (img_y + sub_rect_y) * image->width + sub_rect_x;
+        s32 dest_row_pixel_idx = (y + y_start) * framebuffer->width + x_start;
+        video_draw_row(framebuffer, image, VIDEO_FUNCTION_BLIT, dest_row_pixel_idx, src_row_pixel_idx, x_first, x_last, image_width, flip & BLIT_FLIP_HOR);
+    }
+}
+
+void video_draw_tile_layer(struct Image *framebuffer, struct VideoTileLayer *layer, s32 dest_x, s32 dest_y)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(layer != NULL);
+    ASSERT(layer->tiles != NULL);
+    ASSERT(layer->tile_images != NULL);
+    
+    s32 tile_size = layer->tile_size;
+    s32 layer_width = layer->width * tile_size;
+    s32 layer_height = layer->height * tile_size;
+    video_mark_dirty(framebuffer, dest_x, dest_y, layer_width, layer_height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_DRAW_TILE_LAYER,
+        dest_x + layer_width <= 0 || dest_y + layer_height <= 0 || dest_x >= framebuffer->width || dest_y >= framebuffer->height);
+    
+    // The part of the layer that lands inside the framebuffer. It's clipped once for each row, so
+    // only the first and last tile of a row can be partly drawn.
+    s32 x_first = math_max_s32(0, -dest_x);
+    s32 y_first = math_max_s32(0, -dest_y);
+    s32 x_last = math_min_s32(layer_width, framebuffer->width - dest_x);
+    s32 y_last = math_min_s32(layer_height, framebuffer->height - dest_y);
+    
+    for (s32 y = y_first; y < y_last; ++y)
     {
-        for (s32 x = 0; x < image_width; ++x)
+        u8 *tile_row = &layer->tiles[(y / tile_size) * layer->width];
+        s32 tile_pixel_y = y % tile_size;
+        s32 dest_row_pixel_idx = (y + dest_y) * framebuffer->width + dest_x;
+        
+        for (s32 tile_x = x_first / tile_size; tile_x * tile_size < x_last; ++tile_x)
         {
-            s32 img_x = x;
-            s32 img_y = y;
-            if (flip & BLIT_FLIP_HOR) img_x = image_width - 1 - x;
-            if (flip & BLIT_FLIP_VER) img_y = image_height - 1 - y;
-            s32 image_idx = ((img_y + sub_rect_y) * image->width + (img_x + sub_rect_x)) * 4;
-            
-            s32 xfb = x + x_start;
-            s32 yfb = y + y_start;
+            u8 tile = tile_row[tile_x];
+            if (tile == VIDEO_TILE_NONE) continue;
             
-            if (xfb < 0 || xfb >= framebuffer->width ||
-                yfb < 0 || yfb >= framebuffer->height)
-            {
-                continue;
-            }
-            
-            s32 fb_pixel_idx = yfb * framebuffer->width + xfb;
-            s32 fb_idx = fb_pixel_idx * 4;
-            
-            // Alpha blend
-            u8 src_a = img[image_idx + 3];
-            float percent_src = (float)src_a / 255.f;
-            dest[fb_idx + 0] = video_blend_component(dest[fb_idx + 0], img[image_idx + 0], percent_src);
-            dest[fb_idx + 1] = video_blend_component(dest[fb_idx + 1], img[image_idx + 1], percent_src);
-            dest[fb_idx + 2] = video_blend_component(dest[fb_idx + 2], img[image_idx + 2], percent_src);
-            dest[fb_idx + 3] = 255;
+            struct Image *tile_image = layer->tile_images[tile];
+            ASSERT(tile_image->format == framebuffer->format);
+            s32 tile_start_x = tile_x * tile_size;
+            video_draw_row(
+                framebuffer,
+                tile_image,
+                VIDEO_FUNCTION_DRAW_TILE_LAYER,
+                dest_row_pixel_idx + tile_start_x,
+                tile_pixel_y * tile_image->width,
+                math_max_s32(x_first - tile_start_x, 0),
+                math_min_s32(x_last - tile_start_x, tile_size),
+                tile_size,
+                false);
         }
     }
 }
 
+// Returns the x position of the line of text starting at str.
+static s32 text_line_start_x(struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, enum TextAlign align)
+{
+    if (align != TEXT_ALIGN_CENTER) return dest_x;
+    
+    s32 line_len = 0;
+    while (str[line_len] != '\0' && str[line_len] != '\n') line_len += 1;
+    return dest_x - ((line_len * font->char_width) / 2);
+}
+
 void video_draw_text(struct Image *framebuffer, struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, s32 dest_y, enum TextAlign align)
 {
     ASSERT(framebuffer != NULL);
@@ -371,25 +1191,19 @@ void video_draw_text(struct Image *framebuffer, struct ImageAsciiMonospacedFont
     ASSERT(font->image->data != NULL);
     ASSERT(str != NULL);
     
-    s32 len = str_count_length(str);
     s32 char_width = font->char_width;
     s32 char_height = font->char_height;
     
-    if (align == TEXT_ALIGN_CENTER)
-    {
-        // TODO: Make center alignment work with text containing newlines
-        dest_x = dest_x - ((len * char_width) / 2);
-    }
-    
-    s32 x = dest_x;
+    s32 x = text_line_start_x(font, str, dest_x, align);
     s32 y = dest_y;
     struct Image *image = font->image;
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_DRAW_TEXT, false);
     
-    for (s32 i = 0; i < len; ++i)
+    for (s32 i = 0; str[i] != '\0'; ++i)
     {
         if (str[i] == '\n')
         {
-            x = dest_x;
+            x = text_line_start_x(font, &str[i + 1], dest_x, align);
             y += char_height;
             continue;
         }
@@ -410,4 +1224,324 @@ void video_draw_text(struct Image *framebuffer, struct ImageAsciiMonospacedFont
         
         x += char_width;
     }
+}
+
+void video_draw_text_colored(struct Image *framebuffer, struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, s32 dest_y, enum TextAlign align, struct Color color)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(font != NULL);
+    ASSERT(font->glyph_masks != NULL);
+    ASSERT(str != NULL);
+    
+    s32 char_width = font->char_width;
+    s32 char_height = font->char_height;
+    
+    color.a = 255;
+    u32 color_u32 = video_make_color_u32(color);
+    u32 *fb = (u32 *)framebuffer->data;
+    bool is_indexed = framebuffer->format == IMAGE_FORMAT_INDEXED;
+    u8 color_index = is_indexed ? video_palette_get_index(framebuffer->palette, color) : 0;
+    
+    s32 x = text_line_start_x(font, str, dest_x, align);
+    s32 y = dest_y;
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_COLORED, false);
+    
+    for (s32 i = 0; str[i] != '\0'; ++i)
+    {
+        if (str[i] == '\n')
+        {
+            x = text_line_start_x(font, &str[i + 1], dest_x, align);
+            y += char_height;
+            continue;
+        }
+        
+        s32 glyph_idx = str[i] - 32;
+        if (glyph_idx >= 0 && glyph_idx < font->glyph_count)
+        {
+            u64 mask = font->glyph_masks[glyph_idx];
+            video_mark_dirty(framebuffer, x, y, char_width, char_height);
+            bool is_clipped = (x < 0 || y < 0 ||
+                               x + char_width > framebuffer->width ||
+                               y + char_height > framebuffer->height);
+            
+            for (s32 row = 0; row < char_height && mask != 0; ++row)
+            {
+                for (s32 col = 0; col < char_width; ++col, mask >>= 1)
+                {
+                    if (!(mask & 1))
+                    {
+                        VIDEO_COUNT_SKIPPED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_COLORED, 1);
+                        continue;
+                    }
+                    
+                    s32 xfb = x + col;
+                    s32 yfb = y + row;
+                    if (is_clipped &&
+                        (xfb < 0 || xfb >= framebuffer->width ||
+                         yfb < 0 || yfb >= framebuffer->height))
+                    {
+                        VIDEO_COUNT_SKIPPED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_COLORED, 1);
+                        continue;
+                    }
+                    
+                    if (is_indexed) ((u8 *)framebuffer->data)[yfb * framebuffer->width + xfb] = color_index;
+                    else fb[yfb * framebuffer->width + xfb] = color_u32;
+                    VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_COLORED, yfb * framebuffer->width + xfb, 1);
+                }
+            }
+        }
+        
+        x += char_width;
+    }
+}
+
+void font_build_glyph_masks(struct ImageAsciiMonospacedFont *font)
+{
+    ASSERT(font != NULL);
+    ASSERT(font->image != NULL);
+    ASSERT(font->image->data != NULL);
+    ASSERT(font->char_width * font->char_height <= 64); // Each glyph is packed into a single u64.
+    
+    s32 char_width = font->char_width;
+    s32 char_height = font->char_height;
+    
+    font->glyph_count = font->image->width / char_width;
+    font->glyph_masks = mem_alloc(font->glyph_count * sizeof(font->glyph_masks[0]));
+    
+    u8 *pixels = (u8 *)font->image->data;
+    for (s32 glyph_idx = 0; glyph_idx < font->glyph_count; ++glyph_idx)
+    {
+        u64 mask = 0;
+        for (s32 row = 0; row < char_height; ++row)
+        {
+            for (s32 col = 0; col < char_width; ++col)
+            {
+                s32 idx = (row * font->image->width + glyph_idx * char_width + col) * 4;
+                if (pixels[idx + 3] >= 128) mask |= (u64)1 << (row * char_width + col);
+            }
+        }
+        font->glyph_masks[glyph_idx] = mask;
+    }
+}
+
+// Renders a string into a cache entry's image by copying glyphs. Returns false if it does not fit.
+static bool text_cache_render_entry(struct TextCacheEntry *entry, struct ImageAsciiMonospacedFont *font, const char *str, s32 len, enum TextAlign align)
+{
+    s32 char_width = font->char_width;
+    s32 char_height = font->char_height;
+    
+    // Measure the text.
+    s32 line_len = 0;
+    s32 max_line_len = 0;
+    s32 line_count = 1;
+    for (s32 i = 0; i < len; ++i)
+    {
+        if (str[i] == '\n')
+        {
+            line_len = 0;
+            line_count += 1;
+            continue;
+        }
+        line_len += 1;
+        max_line_len = math_max_s32(max_line_len, line_len);
+    }
+    
+    s32 width = max_line_len * char_width;
+    s32 height = line_count * char_height;
+    if (width > TEXT_CACHE_MAX_WIDTH || height > TEXT_CACHE_MAX_HEIGHT) return false;
+    
+    entry->image.data = entry->pixels;
+    entry->image.width = width;
+    entry->image.height = height;
+    entry->offset_x = 0;
+    if (align == TEXT_ALIGN_CENTER) entry->offset_x = -(width / 2);
+    
+    mem_set_u32(entry->pixels, width * height, 0);
+    
+    // Copy glyphs into the image.
+    u32 *glyphs = (u32 *)font->image->data;
+    s32 x = text_line_start_x(font, str, 0, align) - entry->offset_x;
+    s32 y = 0;
+    for (s32 i = 0; i < len; ++i)
+    {
+        if (str[i] == '\n')
+        {
+            x = text_line_start_x(font, &str[i + 1], 0, align) - entry->offset_x;
+            y += char_height;
+            continue;
+        }
+        
+        s32 glyph_x = (str[i] - 32) * char_width;
+        for (s32 row = 0; row < char_height; ++row)
+        {
+            mem_copy(
+                &entry->pixels[(y + row) * width + x],
+                &glyphs[row * font->image->width + glyph_x],
+                char_width * 4);
+        }
+        
+        x += char_width;
+    }
+    
+    // Find spans of visible pixels.
+    entry->span_count = 0;
+    for (s32 row = 0; row < height; ++row)
+    {
+        s32 col = 0;
+        while (col < width)
+        {
+            u32 alpha = entry->pixels[row * width + col] >> 24;
+            if (alpha == 0)
+            {
+                col += 1;
+                continue;
+            }
+            
+            if (entry->span_count == TEXT_CACHE_MAX_SPANS) return false;
+            
+            struct TextCacheSpan *span = &entry->spans[entry->span_count++];
+            span->x = (u8)col;
+            span->y = (u8)row;
+            span->is_opaque = true;
+            
+            while (col < width)
+            {
+                alpha = entry->pixels[row * width + col] >> 24;
+                if (alpha == 0) break;
+                if (alpha != 255) span->is_opaque = false;
+                col += 1;
+            }
+            
+            span->length = (u8)(col - span->x);
+        }
+    }
+    
+    return true;
+}
+
+void video_draw_text_cached(struct Image *framebuffer, struct TextCache *cache, struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, s32 dest_y, enum TextAlign align)
+{
+    ASSERT(framebuffer != NULL);
+    ASSERT(framebuffer->data != NULL);
+    ASSERT(cache != NULL);
+    ASSERT(font != NULL);
+    ASSERT(font->image != NULL);
+    ASSERT(font->image->data != NULL);
+    ASSERT(str != NULL);
+    
+    // Glyphs of an indexed font are only ever copied or skipped, which is all the cache would save.
+    if (framebuffer->format == IMAGE_FORMAT_INDEXED)
+    {
+        video_draw_text(framebuffer, font, str, dest_x, dest_y, align);
+        return;
+    }
+    
+    // Hash and measure the string in one pass. (FNV-1a)
+    u32 hash = 2166136261u;
+    s32 len = 0;
+    while (str[len] != '\0')
+    {
+        hash = (hash ^ (u8)str[len]) * 16777619u;
+        len += 1;
+    }
+    
+    if (len > TEXT_CACHE_MAX_STRING_LENGTH)
+    {
+        video_draw_text(framebuffer, font, str, dest_x, dest_y, align);
+        return;
+    }
+    
+    cache->use_counter += 1;
+    
+    // Look for an existing entry, otherwise pick the least recently used one.
+    struct TextCacheEntry *entry = NULL;
+    struct TextCacheEntry *oldest = &cache->entries[0];
+    for (s32 i = 0; i < TEXT_CACHE_ENTRY_COUNT; ++i)
+    {
+        struct TextCacheEntry *candidate = &cache->entries[i];
+        
+        if (candidate->is_used &&
+            candidate->hash == hash &&
+            candidate->font == font &&
+            candidate->align == align)
+        {
+            s32 c = 0;
+            while (c < len && candidate->str[c] == str[c]) c += 1;
+            if (c == len && candidate->str[c] == '\0')
+            {
+                entry = candidate;
+                break;
+            }
+        }
+        
+        if (!candidate->is_used || (oldest->is_used && candidate->last_used < oldest->last_used)) oldest = candidate;
+    }
+    
+    if (entry == NULL)
+    {
+        entry = oldest;
+        entry->is_used = false;
+        
+        if (!text_cache_render_entry(entry, font, str, len, align))
+        {
+            video_draw_text(framebuffer, font, str, dest_x, dest_y, align);
+            return;
+        }
+        
+        entry->is_used = true;
+        entry->hash = hash;
+        entry->font = font;
+        entry->align = align;
+        mem_copy(entry->str, (void *)str, len + 1);
+    }
+    
+    entry->last_used = cache->use_counter;
+    
+    // Draw the spans.
+    s32 origin_x = dest_x + entry->offset_x;
+    video_mark_dirty(framebuffer, origin_x, dest_y, entry->image.width, entry->image.height);
+    VIDEO_COUNT_CALL(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_CACHED,
+        origin_x + entry->image.width <= 0 || dest_y + entry->image.height <= 0 ||
+        origin_x >= framebuffer->width || dest_y >= framebuffer->height);
+    u32 *fb = (u32 *)framebuffer->data;
+    u32 *pixels = entry->pixels;
+    for (s32 i = 0; i < entry->span_count; ++i)
+    {
+        struct TextCacheSpan *span = &entry->spans[i];
+        
+        s32 y = dest_y + span->y;
+        if (y < 0 || y >= framebuffer->height)
+        {
+            VIDEO_COUNT_SKIPPED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_CACHED, span->length);
+            continue;
+        }
+        
+        s32 x_start = math_max_s32(origin_x + span->x, 0);
+        s32 x_end = math_min_s32(origin_x + span->x + span->length, framebuffer->width);
+        VIDEO_COUNT_SKIPPED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_CACHED, span->length - math_max_s32(x_end - x_start, 0));
+        if (x_start >= x_end) continue;
+        
+        u32 *src = &pixels[span->y * entry->image.width + (x_start - origin_x)];
+        u32 *dest = &fb[y * framebuffer->width + x_start];
+        
+        if (span->is_opaque)
+        {
+            mem_copy(dest, src, (x_end - x_start) * 4);
+            VIDEO_COUNT_COPIED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_CACHED, y * framebuffer->width + x_start, x_end - x_start);
+            continue;
+        }
+        
+        VIDEO_COUNT_BLENDED(framebuffer, VIDEO_FUNCTION_DRAW_TEXT_CACHED, y * framebuffer->width + x_start, x_end - x_start);
+        for (s32 x = 0; x < x_end - x_start; ++x)
+        {
+            u8 *d = (u8 *)&dest[x];
+            u8 *s = (u8 *)&src[x];
+            u32 inverse_alpha = 255 - s[3];
+            d[0] = video_blend_premultiplied(d[0], s[0], inverse_alpha);
+            d[1] = video_blend_premultiplied(d[1], s[1], inverse_alpha);
+            d[2] = video_blend_premultiplied(d[2], s[2], inverse_alpha);
+            d[3] = 255;
+        }
+    }
 }
\ No newline at end of file
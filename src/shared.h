@@ -6,6 +6,9 @@
 
 #define countof(x)(sizeof(x) / sizeof(x[0]))
 
+#define MATH_PI 3.14159265f
+#define MATH_TAU (2.f * MATH_PI)
+
 enum TextAlign
 {
     TEXT_ALIGN_LEFT,
@@ -21,11 +24,131 @@ struct Color
     u8 a;
 };
 
+struct Rect
+{
+    s32 x;
+    s32 y;
+    s32 w;
+    s32 h;
+};
+
+// Counts the work done by the video_* functions and how many times each framebuffer pixel is written.
+// Slows down drawing, so it's for debugging only.
+#define VIDEO_COUNT_STATS false
+
+#define VIDEO_MAX_DIRTY_RECTS 16
+#define VIDEO_PALETTE_SIZE 256
+#define VIDEO_PALETTE_TRANSPARENT 0 // Palette entry that blits skip.
+#define VIDEO_MAX_PALETTE_REMAPS 8
+#define VIDEO_OVERDRAW_LEVELS 6 // Pixels written 0, 1, 2, 3, 4, and 5 or more times.
+
+// Areas of an image that have been drawn to. Overlapping and touching rects are merged as they're
+// added, and once there's no room left new rects are merged into the closest one.
+struct VideoDirtyRects
+{
+    struct Rect rects[VIDEO_MAX_DIRTY_RECTS];
+    s32 count;
+};
+
+enum VideoFunction
+{
+    VIDEO_FUNCTION_CLEAR_FRAMEBUFFER,
+    VIDEO_FUNCTION_COPY_IMAGE,
+    VIDEO_FUNCTION_FILL_TILED,
+    VIDEO_FUNCTION_DRAW_RECT,
+    VIDEO_FUNCTION_BLIT,
+    VIDEO_FUNCTION_DRAW_TEXT,
+    VIDEO_FUNCTION_DRAW_TEXT_COLORED,
+    VIDEO_FUNCTION_DRAW_TEXT_CACHED,
+    VIDEO_FUNCTION_APPLY_COLOR_LUT,
+    VIDEO_FUNCTION_DRAW_TILE_LAYER,
+    VIDEO_FUNCTION_COUNT,
+};
+
+struct VideoFunctionStats
+{
+    s32 call_count;
+    s32 clipped_away_count; // Calls that didn't draw anything because they were off the image.
+    s32 pixels_copied;
+    s32 pixels_blended;
+    s32 pixels_skipped; // Visited but not written because they were clipped or transparent.
+};
+
+// Only counted when VIDEO_COUNT_STATS is on. Text drawn without the glyph masks or the text cache is
+// made of blits, so those are counted as both.
+struct VideoStats
+{
+    struct VideoFunctionStats function[VIDEO_FUNCTION_COUNT];
+    u8 *overdraw; // Times each pixel has been written, up to 255.
+};
+
+enum ImageFormat
+{
+    IMAGE_FORMAT_RGBA,
+    IMAGE_FORMAT_INDEXED, // One byte per pixel, indexing into a palette.
+    IMAGE_FORMAT_COUNT,
+};
+
+// What each palette entry turns into with a translucent color blended over it, so translucent rects
+// drawn on indexed images are a lookup per pixel. Built on first use, and extended as entries are added.
+struct VideoPaletteRemap
+{
+    u32 color; // Including alpha.
+    s32 built_count;
+    u8 indices[VIDEO_PALETTE_SIZE];
+};
+
+// Colors shared by indexed images. New colors are added as they're used, and once the palette is
+// full the closest existing entry is used instead.
+struct VideoPalette
+{
+    u32 colors[VIDEO_PALETTE_SIZE];
+    s32 count;
+    struct VideoPaletteRemap remaps[VIDEO_MAX_PALETTE_REMAPS];
+    s32 remap_count;
+};
+
+// What each channel value becomes with a color blended over it. Fades, darkening, tints and flashes
+// are all a color blended over the whole screen, so they all cost one lookup per channel.
+struct VideoColorLut
+{
+    struct Color color; // Including alpha.
+    u8 channels[3][256];
+};
+
+#define VIDEO_TILE_NONE 0
+
+// A grid of tiles that's drawn one framebuffer row at a time, so each pixel it covers is drawn once
+// no matter how many tiles there are. Each tile is drawn from the top left of its image.
+struct VideoTileLayer
+{
+    u8 *tiles; // Indices into tile_images, or VIDEO_TILE_NONE.
+    s32 width; // In tiles.
+    s32 height;
+    s32 tile_size;
+    struct Image **tile_images;
+};
+
+enum ImageAlpha
+{
+    IMAGE_ALPHA_BLENDED,
+    IMAGE_ALPHA_BINARY, // Every pixel is fully transparent or fully opaque, so it can be copied or skipped.
+    IMAGE_ALPHA_OPAQUE,
+    IMAGE_ALPHA_COUNT,
+};
+
+// Images that get drawn onto others have their colors premultiplied by their alpha. Indexed images
+// can only be drawn onto other indexed images, and RGBA ones onto RGBA ones.
 struct Image
 {
     void *data;
     s32 width;
     s32 height;
+    enum ImageFormat format;
+    struct VideoPalette *palette; // Only used by indexed images.
+    enum ImageAlpha alpha;
+    struct VideoDirtyRects *dirty_rects; // If set, the video_* functions record where they draw into the image.
+    struct VideoStats *stats; // If set, and stats are compiled in, the video_* functions count their work.
 };
 
 struct ImageAsciiMonospacedFont
@@ -33,6 +156,99 @@ struct ImageAsciiMonospacedFont
     struct Image *image;
     s32 char_width;
     s32 char_height;
+    
+    // One bit per pixel, row by row, built from the font image by font_build_glyph_masks.
+    u64 *glyph_masks;
+    s32 glyph_count;
+};
+
+// Sized for the menu strings in the 6x8 font, up to 10 characters on 2 lines. Anything larger is drawn
+// uncached. All entries together take about 80KB.
+#define TEXT_CACHE_ENTRY_COUNT 16
+#define TEXT_CACHE_MAX_STRING_LENGTH 21
+#define TEXT_CACHE_MAX_WIDTH 64
+#define TEXT_CACHE_MAX_HEIGHT 16
+#define TEXT_CACHE_MAX_SPANS 256
+
+// A horizontal run of non-transparent pixels in a cached text image.
+struct TextCacheSpan
+{
+    u8 x;
+    u8 y;
+    u8 length;
+    bool is_opaque; // All pixels in the span have an alpha of 255 and can be copied.
+};
+
+struct TextCacheEntry
+{
+    bool is_used;
+    u32 last_used;
+    u32 hash;
+    struct ImageAsciiMonospacedFont *font;
+    enum TextAlign align;
+    char str[TEXT_CACHE_MAX_STRING_LENGTH + 1];
+    s32 offset_x; // Relative to the position the text is drawn at.
+    struct Image image;
+    u32 pixels[TEXT_CACHE_MAX_WIDTH * TEXT_CACHE_MAX_HEIGHT];
+    struct TextCacheSpan spans[TEXT_CACHE_MAX_SPANS];
+    s32 span_count;
+};
+
+// Stores pre-rendered runs of text so that strings which are drawn every frame are only rendered once.
+struct TextCache
+{
+    struct TextCacheEntry entries[TEXT_CACHE_ENTRY_COUNT];
+    u32 use_counter;
+};
+
+// Xorshift random number generator state. Each simulation owns its own so they don't disturb each other.
+struct Rng
+{
+    u32 seed;
+};
+
+// Length-tracked string builder. Appends are bounds-checked and truncate instead of overflowing.
+struct StrBuf
+{
+    char *data;
+    s32 length; // Not including NULL-terminator
+    s32 capacity; // Including NULL-terminator
+    bool has_overflowed;
+};
+
+#define INPUT_KEY_COUNT 256
+#define INPUT_QUEUE_CAPACITY 64 // Must be a power of 2.
+
+struct InputEvent
+{
+    f64 time_ms;
+    u8 key;
+    bool is_down;
+};
+
+// Ring buffer of keyboard events. Filled by the host between frames and drained at the start of each frame.
+struct InputQueue
+{
+    struct InputEvent events[INPUT_QUEUE_CAPACITY];
+    u32 read_idx;
+    u32 write_idx;
+    s32 dropped_count;
+};
+
+struct InputState
+{
+    bool is_down[INPUT_KEY_COUNT];
+    u8 press_count[INPUT_KEY_COUNT]; // Presses since the start of the frame.
+    f64 last_press_time_ms[INPUT_KEY_COUNT];
+    s32 any_press_count;
+    
+    // Keys with a non-zero press_count, so they can be reset without scanning every key.
+    u8 pressed_keys[INPUT_QUEUE_CAPACITY];
+    s32 pressed_keys_count;
+    
+    // Events drained this frame, in the order they happened.
+    struct InputEvent frame_events[INPUT_QUEUE_CAPACITY];
+    s32 frame_event_count;
 };
 
 enum BlitFlip
@@ -51,14 +267,17 @@ s32 math_min_s32(s32 a, s32 b);
 s32 math_max_s32(s32 a, s32 b);
 s32 math_abs_s32(s32 x);
 f32 math_abs_f32(f32 x);
-f32 math_mod_f32(f32 x, f32 y);
+f32 math_floor_f32(f32 x);
+f32 math_mod_f32(f32 x, f32 y); // Result is in [0, y)
 s32 math_round_f32_to_s32(f32 x);
 f32 math_sin(f32 x); // In radians
+f32 math_cos(f32 x); // In radians
 
 // Random number generation
-void rng_set_seed(u32 seed);
-u32 rng_get_u32();
-u32 rng_get_u32_range(u32 min_inclusive, u32 max_inclusive);
+void rng_set_seed(struct Rng *rng, u32 seed);
+u32 rng_get_seed(struct Rng *rng);
+u32 rng_get_u32(struct Rng *rng);
+u32 rng_get_u32_range(struct Rng *rng, u32 min_inclusive, u32 max_inclusive);
 
 // Memory
 void mem_copy(void *destination, void *source, s32 bytes);
@@ -66,25 +285,59 @@ void mem_set_u8(void *destination, s32 count, u8 value);
 void mem_set_u32(void *destination, s32 count, u32 value);
 void mem_set_s32(void *destination, s32 count, s32 value);
 void *mem_alloc(s32 bytes);
+void mem_write_u32_le(void *destination, u32 value);
+u32 mem_read_u32_le(void *source);
 
 // Strings
 s32 str_count_length(const char *str); // Not including NULL-terminator
-bool str_s32_to_str(const char *str, s32 max_length, s32 number);
+s32 str_format_s32(char *dest, s32 capacity, s32 number); // Returns the length written, or -1 if it does not fit.
 
-void strbuf_clear(void);
-void strbuf_push_string(const char *str);
-void strbuf_push_s32(s32 num);
-void strbuf_push_char(u8 c);
-char *strbuf_get(void);
+void strbuf_init(struct StrBuf *buf, char *storage, s32 capacity);
+void strbuf_clear(struct StrBuf *buf);
+void strbuf_push_string(struct StrBuf *buf, const char *str);
+void strbuf_push_s32(struct StrBuf *buf, s32 num);
+void strbuf_push_char(struct StrBuf *buf, char c);
+void strbuf_printf(struct StrBuf *buf, const char *format, ...); // Supports %d, %s, %c and %%.
+char *strbuf_get(struct StrBuf *buf);
+
+// Input
+bool input_queue_push(struct InputQueue *queue, struct InputEvent event);
+bool input_queue_pop(struct InputQueue *queue, struct InputEvent *event);
+void input_begin_frame(struct InputState *input, struct InputQueue *queue);
+bool input_is_down(struct InputState *input, s32 key);
+bool input_was_pressed(struct InputState *input, s32 key); // Pressed since the start of the frame.
+bool input_any_was_pressed(struct InputState *input);
 
 // Image
+s32 image_get_bytes_per_pixel(struct Image *image);
 s32 image_calculate_size(struct Image *image);
+void image_premultiply_alpha(struct Image *image); // Also works out the image's alpha kind.
+void image_convert_to_indexed(struct Image *image, struct VideoPalette *palette); // In place. Pixels less than half opaque become transparent.
+
+// Fonts
+void font_build_glyph_masks(struct ImageAsciiMonospacedFont *font);
 
 // Rendering
 struct Color video_make_color(u8 r, u8 g, u8 b);
+void video_palette_init(struct VideoPalette *palette);
+u8 video_palette_get_index(struct VideoPalette *palette, struct Color color); // Adds the color if it's new and there's room.
+void video_expand_indexed_rows(struct Image *dest, struct Image *indexed, s32 first_row, s32 row_count); // Writes RGBA pixels into an image of the same size.
+void video_dirty_rects_clear(struct VideoDirtyRects *dirty_rects);
+void video_dirty_rects_add(struct VideoDirtyRects *dirty_rects, struct Rect rect);
+bool video_dirty_rects_get_row_range(struct VideoDirtyRects *dirty_rects, s32 *first_row, s32 *row_count); // Returns false if nothing is dirty.
+void video_stats_clear(struct VideoStats *stats, s32 pixel_count);
+s32 video_stats_get_overdraw_level(u8 write_count);
+void video_draw_overdraw_heatmap(struct Image *framebuffer); // Replaces each pixel with a color for how many times it was written.
 void video_clear_framebuffer(struct Image *framebuffer, struct Color color);
+void video_copy_image(struct Image *framebuffer, struct Image *image); // The image must be the same size as the framebuffer.
+void video_fill_tiled(struct Image *framebuffer, struct Image *pattern, s32 offset_x, s32 offset_y); // Copies an opaque pattern repeated over the whole framebuffer.
 void video_draw_rect(struct Image *framebuffer, s32 rect_x, s32 rect_y, s32 rect_w, s32 rect_h, struct Color color);
+void video_color_lut_build(struct VideoColorLut *lut, struct Color color);
+void video_apply_color_lut(struct Image *framebuffer, struct VideoColorLut *lut); // Over the whole framebuffer.
+void video_draw_tile_layer(struct Image *framebuffer, struct VideoTileLayer *layer, s32 dest_x, s32 dest_y);
 void video_blit(struct Image *framebuffer, struct Image *image, s32 dest_x, s32 dest_y, s32 sub_rect_x, s32 sub_rect_y, s32 sub_rect_w, s32 sub_rect_h, enum BlitFlip flip);
 void video_draw_text(struct Image *framebuffer, struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, s32 dest_y, enum TextAlign align);
+void video_draw_text_colored(struct Image *framebuffer, struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, s32 dest_y, enum TextAlign align, struct Color color);
+void video_draw_text_cached(struct Image *framebuffer, struct TextCache *cache, struct ImageAsciiMonospacedFont *font, const char *str, s32 dest_x, s32 dest_y, enum TextAlign align);
 
 #endif
\ No newline at end of file
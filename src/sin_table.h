@@ -1,109 +1,33 @@
 #ifndef SIN_TABLE__H
 #define SIN_TABLE__H
 
-// Auto-generated sine table.
+// Sine table generated at compile time.
+// Entry i holds sin(2 * pi * i / MATH_SIN_TABLE_SIZE). The extra entry at the end duplicates entry 0
+// so that math_sin can interpolate between idx and idx + 1 without wrapping.
 
-f32 math_sin_table[100] = {
-    0.000000, 
-    0.062791, 
-    0.125333, 
-    0.187381, 
-    0.248690, 
-    0.309017, 
-    0.368125, 
-    0.425779, 
-    0.481754, 
-    0.535827, 
-    0.587785, 
-    0.637424, 
-    0.684547, 
-    0.728969, 
-    0.770513, 
-    0.809017, 
-    0.844328, 
-    0.876307, 
-    0.904827, 
-    0.929776, 
-    0.951057, 
-    0.968583, 
-    0.982287, 
-    0.992115, 
-    0.998027, 
-    1.000000, 
-    0.998027, 
-    0.992115, 
-    0.982287, 
-    0.968583, 
-    0.951057, 
-    0.929776, 
-    0.904827, 
-    0.876307, 
-    0.844328, 
-    0.809017, 
-    0.770513, 
-    0.728969, 
-    0.684547, 
-    0.637424, 
-    0.587785, 
-    0.535827, 
-    0.481754, 
-    0.425779, 
-    0.368125, 
-    0.309017, 
-    0.248690, 
-    0.187381, 
-    0.125333, 
-    0.062791, 
-    0.000000, 
-    -0.062791, 
-    -0.125333, 
-    -0.187381, 
-    -0.248690, 
-    -0.309017, 
-    -0.368125, 
-    -0.425779, 
-    -0.481754, 
-    -0.535827, 
-    -0.587785, 
-    -0.637424, 
-    -0.684547, 
-    -0.728969, 
-    -0.770513, 
-    -0.809017, 
-    -0.844328, 
-    -0.876307, 
-    -0.904827, 
-    -0.929776, 
-    -0.951057, 
-    -0.968583, 
-    -0.982287, 
-    -0.992115, 
-    -0.998027, 
-    -1.000000, 
-    -0.998027, 
-    -0.992115, 
-    -0.982287, 
-    -0.968583, 
-    -0.951057, 
-    -0.929776, 
-    -0.904827, 
-    -0.876307, 
-    -0.844328, 
-    -0.809017, 
-    -0.770513, 
-    -0.728969, 
-    -0.684547, 
-    -0.637424, 
-    -0.587785, 
-    -0.535827, 
-    -0.481754, 
-    -0.425779, 
-    -0.368125, 
-    -0.309017, 
-    -0.248690, 
-    -0.187381, 
-    -0.125333, 
-    -0.062791, 
+#define MATH_SIN_TABLE_SIZE 256
+
+// Taylor series of sin(x), accurate to well below f32 precision for x in [-pi/2, pi/2].
+#define MATH_SIN_TAYLOR(x) \
+    ((x) * (1.0 - (x) * (x) / 6.0 * (1.0 - (x) * (x) / 20.0 * (1.0 - (x) * (x) / 42.0 * \
+    (1.0 - (x) * (x) / 72.0 * (1.0 - (x) * (x) / 110.0 * (1.0 - (x) * (x) / 156.0)))))))
+
+// Reflects table index i into [-pi/2, pi/2] using sin(pi - a) = sin(a) and sin(a - 2pi) = sin(a).
+#define MATH_SIN_REFLECT(i) \
+    ((i) <= MATH_SIN_TABLE_SIZE / 4 ? (i) : \
+     (i) <= 3 * MATH_SIN_TABLE_SIZE / 4 ? MATH_SIN_TABLE_SIZE / 2 - (i) : \
+     (i) - MATH_SIN_TABLE_SIZE)
+
+#define MATH_SIN_ENTRY(i) ((f32)MATH_SIN_TAYLOR(MATH_SIN_REFLECT(i) * (6.283185307179586 / MATH_SIN_TABLE_SIZE)))
+
+#define MATH_SIN_ENTRIES_4(i) MATH_SIN_ENTRY(i), MATH_SIN_ENTRY(i + 1), MATH_SIN_ENTRY(i + 2), MATH_SIN_ENTRY(i + 3),
+#define MATH_SIN_ENTRIES_16(i) MATH_SIN_ENTRIES_4(i) MATH_SIN_ENTRIES_4(i + 4) MATH_SIN_ENTRIES_4(i + 8) MATH_SIN_ENTRIES_4(i + 12)
+#define MATH_SIN_ENTRIES_64(i) MATH_SIN_ENTRIES_16(i) MATH_SIN_ENTRIES_16(i + 16) MATH_SIN_ENTRIES_16(i + 32) MATH_SIN_ENTRIES_16(i + 48)
+#define MATH_SIN_ENTRIES_256(i) MATH_SIN_ENTRIES_64(i) MATH_SIN_ENTRIES_64(i + 64) MATH_SIN_ENTRIES_64(i + 128) MATH_SIN_ENTRIES_64(i + 192)
+
+static const f32 math_sin_table[MATH_SIN_TABLE_SIZE + 1] = {
+    MATH_SIN_ENTRIES_256(0)
+    MATH_SIN_ENTRY(MATH_SIN_TABLE_SIZE),
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -3,11 +3,8 @@
 #include "shared.h"
 #include <stdbool.h>
 
-#define CANVAS_WIDTH 64
-#define CANVAS_HEIGHT 64
-#define CANVAS_SCALE 6
-
-#define TEXT_Y_MIDDLE ((CANVAS_HEIGHT / 2) - 4)
+#define MENU_BG_TILE_SIZE 24 // The menu background image repeats every this many pixels.
+#define LAYOUT_HEIGHT 64 // Screens are laid out for this many rows, centered on taller canvases.
 
 #define LEVEL_COUNT 4
 #define LEVEL_MAX_WIDTH 1024
@@ -16,8 +13,44 @@
 #define LEVEL_MAX_FINISH_TILES 32
 #define LEVEL_MAX_SPIKE_TILES 512
 #define LEVEL_MAX_MOVING_BLOCK_TILES 512
+#define LEVEL_MAX_HAZARD_SCHEDULES 4096
+#define LEVEL_HAZARD_SCHEDULE_BYTES 16 // Enough for the longest moving block bounce of 2 * (LEVEL_MAX_HEIGHT - 1) beats.
+#define LEVEL_HAZARD_HASH_SLOTS (LEVEL_MAX_HAZARD_SCHEDULES * 2) // Must be a power of 2.
+#define LEVEL_HAZARD_SCHEDULE_NEVER 0
+#define LEVEL_HAZARD_SCHEDULE_ALWAYS 1
+
+#define BPM_TO_BEAT_LEN_MS(x) (60000.0 / x)
+
+// Level image pixels are compared as little-endian u32s with the alpha channel masked off.
+#define LEVEL_PALETTE_RGB(r, g, b) (((u32)(b) << 16) | ((u32)(g) << 8) | (u32)(r))
+#define LEVEL_PALETTE_RGB_MASK 0x00FFFFFF
+
+// Replay logs are a header followed by a list of input events, stored little-endian.
+// Header: magic (u32), version (u8), level index (u8), result (u8), reserved (u8), rng seed (u32), end tick (u32), event count (u32)
+// Event: time since level start in microseconds (u32), key (u8), is down (u8)
+#define REPLAY_MAGIC 0x50525153 // "SQRP"
+#define REPLAY_VERSION 2
+#define REPLAY_HEADER_SIZE 20
+#define REPLAY_EVENT_SIZE 6
+#define REPLAY_MAX_EVENTS 4096
+#define REPLAY_MAX_SIZE (REPLAY_HEADER_SIZE + REPLAY_MAX_EVENTS * REPLAY_EVENT_SIZE)
+
+#define PRACTICE_CHECKPOINT_BEATS 8
+
+// The solver stores one bit per row, so levels can't be taller than 64 tiles.
+#define SOLVER_MAX_TICKS ((LEVEL_MAX_WIDTH + 1) * 4)
+#if LEVEL_MAX_HEIGHT > 64
+#error "The solver needs LEVEL_MAX_HEIGHT to be at most 64"
+#endif
+
+#define PROFILER_SAMPLE_COUNT 120 // Two seconds at 60 frames per second.
+#define PROFILER_EXPORT_CAPACITY 16384
 
-#define BPM_TO_BEAT_LEN_MS(x) (60000.f / x)
+#define TELEMETRY_BUCKET_COUNT 96 // Covers frame times up to 2^24 microseconds.
+#define TELEMETRY_FRAME_BUDGET_US 16667
+#define TELEMETRY_EXPORT_CAPACITY 2048
+
+#define RENDER_STATS_EXPORT_CAPACITY 2048
 
 #define SPACE_TO_MOVE false
 
@@ -25,8 +58,14 @@
 
 #define PLAY_COWBELL false
 
+#define PLAY_BEAT_FLASH false
+
 #define GOD_MODE false
 
+// Draw with one byte palette indices instead of RGBA, and only expand the presented rows to RGBA.
+// Translucent pixels in sprites become either fully transparent or opaque.
+#define INDEXED_COLOR false
+
 enum ImageId
 {
     IMAGE_ID_FONT_SMALL,
@@ -50,6 +89,18 @@ enum ImageId
     IMAGE_ID_COUNT,
 };
 
+// What the level's tile layer shows in each tile. Where entities overlap, the later one is shown.
+enum LevelLayerTile
+{
+    LEVEL_LAYER_TILE_NONE = VIDEO_TILE_NONE,
+    LEVEL_LAYER_TILE_WALL,
+    LEVEL_LAYER_TILE_FINISH,
+    LEVEL_LAYER_TILE_SPIKES_DOWN,
+    LEVEL_LAYER_TILE_SPIKES_UP,
+    LEVEL_LAYER_TILE_MOVING_BLOCK,
+    LEVEL_LAYER_TILE_COUNT,
+};
+
 enum FontId
 {
     FONT_ID_SMALL,
@@ -82,11 +133,96 @@ enum StateId
     STATE_ID_COUNT,
 };
 
+enum PlayResult
+{
+    PLAY_RESULT_NONE,
+    PLAY_RESULT_WIN,
+    PLAY_RESULT_LOSE,
+};
+
+enum ProfileZone
+{
+    PROFILE_ZONE_FRAME,
+    PROFILE_ZONE_CLEAR,
+    PROFILE_ZONE_WALLS,
+    PROFILE_ZONE_ENTITIES,
+    PROFILE_ZONE_TEXT,
+    PROFILE_ZONE_OVERLAYS,
+    PROFILE_ZONE_SIMULATION,
+    PROFILE_ZONE_PRESENT,
+    PROFILE_ZONE_COUNT,
+};
+
+enum ProfilerExportFormat
+{
+    PROFILER_EXPORT_FORMAT_JSON,
+    PROFILER_EXPORT_FORMAT_CSV,
+    PROFILER_EXPORT_FORMAT_COUNT,
+};
+
+enum LevelTileKind
+{
+    LEVEL_TILE_KIND_EMPTY,
+    LEVEL_TILE_KIND_WALL,
+    LEVEL_TILE_KIND_PLAYER_START,
+    LEVEL_TILE_KIND_FINISH,
+    LEVEL_TILE_KIND_MOVING_BLOCK_UP,
+    LEVEL_TILE_KIND_MOVING_BLOCK_DOWN,
+    LEVEL_TILE_KIND_MOVING_BLOCK_RANDOM,
+    LEVEL_TILE_KIND_SPIKES,
+    LEVEL_TILE_KIND_SPIKES_OFF_BEAT,
+    LEVEL_TILE_KIND_INVALID,
+    LEVEL_TILE_KIND_COUNT,
+};
+
 struct LevelEntity
 {
     s32 tile_x;
     s32 tile_y;
-    s32 tick_capacitor;
+};
+
+// Spikes and moving blocks are stored as parallel arrays sorted by column, so the ones in column x
+// are the contiguous range [column_start[x], column_start[x + 1]). Their state is a function of the tick.
+struct LevelSpikes
+{
+    s32 count;
+    s16 tile_x[LEVEL_MAX_SPIKE_TILES];
+    s16 tile_y[LEVEL_MAX_SPIKE_TILES];
+    bool is_up_start[LEVEL_MAX_SPIKE_TILES];
+    u16 column_start[LEVEL_MAX_WIDTH + 1];
+};
+
+struct LevelMovingBlocks
+{
+    s32 count;
+    s16 tile_x[LEVEL_MAX_MOVING_BLOCK_TILES];
+    s16 tile_y_start[LEVEL_MAX_MOVING_BLOCK_TILES];
+    s8 y_direction_start[LEVEL_MAX_MOVING_BLOCK_TILES];
+    
+    // Blocks bounce between the walls above and below them. Unfolded, the bounce is a loop of
+    // bounce_period steps, and the block starts bounce_phase_start steps into it.
+    s16 bounce_top_y[LEVEL_MAX_MOVING_BLOCK_TILES];
+    s16 bounce_length[LEVEL_MAX_MOVING_BLOCK_TILES];
+    s16 bounce_period[LEVEL_MAX_MOVING_BLOCK_TILES];
+    s16 bounce_phase_start[LEVEL_MAX_MOVING_BLOCK_TILES];
+    
+    u16 column_start[LEVEL_MAX_WIDTH + 1];
+};
+
+// When each tile is deadly, built once the level is loaded. Entities repeat every few beats, so each
+// tile points to a schedule of whether it's deadly on each beat of its period. Schedules are stored
+// rotated to start on their first deadly beat so that tiles whose schedules only differ by when they
+// start can share one, and empty tiles and walls use the first two.
+struct LevelHazards
+{
+    u16 tile_schedule[LEVEL_TILE_COUNT];
+    u8 tile_schedule_shift[LEVEL_TILE_COUNT]; // Beats to add to the beat number before looking it up.
+    u8 schedule_period[LEVEL_MAX_HAZARD_SCHEDULES]; // In beats.
+    u8 schedule_bits[LEVEL_MAX_HAZARD_SCHEDULES][LEVEL_HAZARD_SCHEDULE_BYTES];
+    s32 schedule_count;
+    
+    // Schedule index + 1 for each hash slot, or 0 if the slot is free. Only used while building.
+    u16 hash_slots[LEVEL_HAZARD_HASH_SLOTS];
 };
 
 struct Level
@@ -100,23 +236,208 @@ struct Level
     struct LevelEntity finish[LEVEL_MAX_FINISH_TILES];
     s32 finish_count;
     
-    struct LevelSpike
-    {
-        struct LevelEntity entity;
-        bool is_up_start;
-        bool is_up;
-    } spikes[LEVEL_MAX_SPIKE_TILES];
-    s32 spikes_count;
+    struct LevelSpikes spikes;
+    struct LevelMovingBlocks moving_blocks;
+    struct LevelHazards hazards;
+};
+
+struct Replay
+{
+    u8 data[REPLAY_MAX_SIZE];
+    s32 size;
+    s32 event_count;
+    bool is_recording;
+    bool has_overflowed;
+};
+
+// The parts of the play state that change while a level is played. Entities are a function of
+// the tick count, so they don't need saving.
+struct PlaySnapshot
+{
+    s32 player_tile_pos_x;
+    s32 player_tile_pos_y;
+    s32 player_tick_capacitor;
+    s32 play_tick_count;
+    f32 camera_pos_x;
+    f32 camera_pos_y;
+    u32 rng_seed;
+};
+
+// Per-tick results of the solver's forward pass, one bit per row.
+struct Solver
+{
+    u64 safe_rows[SOLVER_MAX_TICKS]; // Rows of the player's column that aren't deadly.
+    u64 finish_rows[SOLVER_MAX_TICKS];
+    u64 reachable_rows[SOLVER_MAX_TICKS];
+    u64 path_counts[LEVEL_MAX_HEIGHT];
+    s32 run_ticks[2][LEVEL_MAX_HEIGHT];
+};
+
+struct LevelSolution
+{
+    bool is_solvable;
+    u64 winning_path_count; // Distinct sequences of rows at each tick. Saturates.
+    s32 first_win_tick;
+    s32 reaction_window_ticks; // -1 if the player never has to move to win.
+    f32 reaction_window_ms;
+    f64 solve_time_ms;
+};
+
+// Everything the level simulation reads or writes. Contexts are independent of each other and of
+// the game, so replays and fast-forwarding can run on their own copies.
+struct PlayContext
+{
+    struct Level *level;
+    struct Rng rng; // Used while loading the level.
+    s32 level_idx;
+    u32 level_rng_seed; // RNG state the level was loaded with.
+    f64 beat_len_ms;
+    s32 player_tile_pos_x;
+    s32 player_tile_pos_y;
+    s32 player_tick_capacitor;
+    s32 tick_count; // Tick n happens n quarter beats after the start of the level.
+};
+
+// Time spent in each zone over the last PROFILER_SAMPLE_COUNT frames. A zone can be entered several
+// times in a frame and the times add up.
+struct Profiler
+{
+    f64 zone_start_time_ms[PROFILE_ZONE_COUNT];
+    f64 zone_frame_time_ms[PROFILE_ZONE_COUNT];
+    f32 samples_ms[PROFILER_SAMPLE_COUNT][PROFILE_ZONE_COUNT];
+    s32 sample_write_idx;
+    s32 sample_count;
+    bool is_overlay_visible;
+    
+    char export_storage[PROFILER_EXPORT_CAPACITY];
+    s32 export_length;
+};
+
+struct TelemetrySummary
+{
+    s32 frame_count;
+    s32 p50_frame_us;
+    s32 p99_frame_us;
+    s32 p999_frame_us;
+    s32 over_budget_frame_count;
+    s32 multi_tick_frame_count;
+    s32 average_audio_drift_us; // Positive when the music is ahead of the ticks.
+    s32 max_audio_drift_us;
+};
+
+// Always-on counters, cheap enough to update every frame. Frame times are counted in buckets that
+// grow with the time: up to 4 microseconds each bucket is 1 microsecond wide, and after that there
+// are four buckets per power of two, so percentiles are within 25% of the real value.
+struct Telemetry
+{
+    u32 frame_time_buckets[TELEMETRY_BUCKET_COUNT];
+    s32 frame_count;
+    s32 over_budget_frame_count;
+    s32 multi_tick_frame_count; // Frames where more than one tick was due.
+    s32 extra_tick_count; // Ticks beyond the first in those frames.
+    f64 audio_drift_total_ms;
+    f64 max_audio_drift_ms;
+    s32 audio_drift_sample_count;
+    
+    struct TelemetrySummary previous_session; // Loaded from local storage at startup.
+    
+    char export_storage[TELEMETRY_EXPORT_CAPACITY];
+    s32 export_length;
+};
+
+// The video_* counters for the last frame, and a heatmap of how many times each pixel was drawn to,
+// toggled with the O key. Only collected when VIDEO_COUNT_STATS is on.
+struct RenderStats
+{
+    struct VideoStats frame; // Counted while the current frame is drawn.
+    struct VideoFunctionStats last_frame[VIDEO_FUNCTION_COUNT];
+    s32 last_frame_overdraw[VIDEO_OVERDRAW_LEVELS]; // Number of pixels at each overdraw level.
+    bool is_heatmap_visible;
     
-    struct LevelMovingBlock
-    {
-        struct LevelEntity entity;
-        s32 tile_x_start;
-        s32 tile_y_start;
-        s32 y_direction_start;
-        s32 y_direction;
-    } moving_blocks[LEVEL_MAX_MOVING_BLOCK_TILES];
-    s32 moving_blocks_count;
+    char export_storage[RENDER_STATS_EXPORT_CAPACITY];
+    s32 export_length;
+};
+
+// A copy of the last screen that was drawn from inputs which don't change every frame, so it can be
+// put back instead of drawn again. The key tells apart the different screens a state can show.
+struct FrameCache
+{
+    struct Image image;
+    u32 key;
+    bool is_valid; // Cleared whenever the state changes.
+};
+
+// A color blended over the whole frame once the screen is drawn, before the tool overlays. States set
+// it on the frames they want it. It changes pixels the screen's own drawing doesn't know about, so
+// the frame after it is drawn in full.
+struct PostProcess
+{
+    struct Color color; // Nothing is done when it's transparent.
+    struct VideoColorLut lut; // Rebuilt when a different color is wanted.
+    bool is_lut_built;
+    bool was_applied;
+};
+
+// All mutable game state. Assets are loaded once and shared read-only, so they stay outside.
+struct GameContext
+{
+    enum StateId current_state;
+    struct Image framebuffer;
+    struct VideoDirtyRects framebuffer_dirty_rects; // Drawn to this frame, and so need presenting.
+    struct VideoPalette palette; // Only used with INDEXED_COLOR.
+    struct Image present_buffer; // RGBA pixels read by the host, when the framebuffer is indexed.
+    
+    // The framebuffer is kept between frames. Screens that only change in places redraw just those
+    // places, unless the state changed or something was drawn over the whole screen.
+    enum StateId last_frame_state;
+    bool is_full_redraw_needed;
+    struct FrameCache frame_cache;
+    struct PostProcess post_process;
+    struct InputQueue input_queue;
+    struct InputState input;
+    struct TextCache text_cache;
+    char strbuf_storage[512];
+    struct StrBuf strbuf;
+    struct Rng rng;
+    f64 last_frame_start_time_ms;
+    f32 delta_time_s;
+    
+    // Menus
+    s32 loading_drawn_percent;
+    f64 splash_timer_start_ms;
+    bool has_played_splash_sound;
+    f32 title_angle;
+    bool is_title_text_visible;
+    f32 title_text_time_capacitor_s;
+    f32 menu_bg_pos;
+    f32 hog_pos;
+    f64 hog_timer_start_ms;
+    s32 selected_level_idx;
+    s32 level_idx_unlocked;
+    bool is_practice_mode;
+    
+    // Level being played
+    struct PlayContext play;
+    enum ImageId level_wall_image_id;
+    u8 *level_layer_tiles; // The visible columns of the level, filled in every frame.
+    enum AudioId level_music_audio_id;
+    f64 level_load_time_ms[LEVEL_COUNT];
+    f64 level_start_time_ms;
+    f64 level_simulated_time_ms; // Level time the simulation has been run up to. Input is never applied before it.
+    f32 camera_pos_x;
+    f32 camera_pos_y;
+    bool has_practice_checkpoint;
+    struct PlaySnapshot practice_checkpoint;
+    
+    // Replays and tools
+    struct Replay replay_recording;
+    u8 replay_playback_data[REPLAY_MAX_SIZE];
+    struct PlayContext headless_play; // Replays and the solver run on their own level copy.
+    struct Solver solver;
+    struct LevelSolution solution;
+    struct Profiler profiler;
+    struct Telemetry telemetry;
+    struct RenderStats render_stats;
 };
 
 #if PRINT_SIZE_OF_LEVEL_STRUCT
@@ -124,36 +445,152 @@ struct Level
 char (*__kaboom)[sizeof(struct Level)] = 1;
 #endif
 
-static struct Image framebuffer;
-static s32 keyboard_state[255] = {0};
+// Internal resolutions the game can be drawn at, picked at startup from local storage. Each is scaled up
+// to roughly the same size on the page.
+struct CanvasResolution
+{
+    s32 width;
+    s32 height;
+    f32 scale;
+};
+
+static const struct CanvasResolution canvas_resolutions[] = {
+    {64, 64, 6.f},
+    {256, 144, 3.f},
+    {480, 270, 1.5f},
+};
+
 static struct Image image[IMAGE_ID_COUNT] = {0};
 static struct ImageAsciiMonospacedFont font[FONT_ID_COUNT] = {0};
 static s32 audio[AUDIO_ID_COUNT] = {0};
-static s32 last_frame_start_time_ms = 0;
-static s32 last_frame_duration_ms = 0;
-static f32 delta_time_s = 0.f;
-
-void on_frame_state_pre_load(void);
-void on_frame_state_loading(void);
-void on_frame_state_splash(void);
-void on_frame_state_title(void);
-void on_frame_state_select(void);
-void on_frame_state_play(void);
-void on_frame_state_win(void);
-void on_frame_state_lose(void);
-
-void draw_menu_bg(void);
-bool load_level_from_image(enum ImageId image_id);
-void draw_level(void);
-void restart_level(void);
-void draw_8x8_tile(enum ImageId image_id, s32 x, s32 y);
-bool *get_level_wall_at_pos(s32 x, s32 y);
-struct LevelSpike *get_level_spike_at_pos(s32 x, s32 y);
-struct LevelMovingBlock *get_level_moving_block_at_pos(s32 x, s32 y);
-struct LevelEntity *get_level_finish_at_pos(s32 x, s32 y);
-
-static enum StateId current_state = STATE_ID_PRE_LOAD;
-void (*state_on_frame[STATE_ID_COUNT])(void) = {
+
+// Built from the assets once they've loaded. The menu background is darkened and opaque, and is
+// wide enough to cover a row of the canvas in at most two copies. The hog is darkened to match.
+static struct Image menu_bg_pattern = {0};
+static struct Image hog_darkened = {0};
+
+static const char *profile_zone_name[PROFILE_ZONE_COUNT] = {
+    [PROFILE_ZONE_FRAME] = "frame",
+    [PROFILE_ZONE_CLEAR] = "clear",
+    [PROFILE_ZONE_WALLS] = "walls",
+    [PROFILE_ZONE_ENTITIES] = "entities",
+    [PROFILE_ZONE_TEXT] = "text",
+    [PROFILE_ZONE_OVERLAYS] = "overlays",
+    [PROFILE_ZONE_SIMULATION] = "simulation",
+    [PROFILE_ZONE_PRESENT] = "present",
+};
+
+// Short enough to fit the overlay on the small canvas.
+static const char *profile_zone_label[PROFILE_ZONE_COUNT] = {
+    [PROFILE_ZONE_FRAME] = "FR",
+    [PROFILE_ZONE_CLEAR] = "CL",
+    [PROFILE_ZONE_WALLS] = "WA",
+    [PROFILE_ZONE_ENTITIES] = "EN",
+    [PROFILE_ZONE_TEXT] = "TX",
+    [PROFILE_ZONE_OVERLAYS] = "OV",
+    [PROFILE_ZONE_SIMULATION] = "SI",
+    [PROFILE_ZONE_PRESENT] = "PR",
+};
+
+static const char *video_function_name[VIDEO_FUNCTION_COUNT] = {
+    [VIDEO_FUNCTION_CLEAR_FRAMEBUFFER] = "clear_framebuffer",
+    [VIDEO_FUNCTION_COPY_IMAGE] = "copy_image",
+    [VIDEO_FUNCTION_FILL_TILED] = "fill_tiled",
+    [VIDEO_FUNCTION_DRAW_RECT] = "draw_rect",
+    [VIDEO_FUNCTION_BLIT] = "blit",
+    [VIDEO_FUNCTION_DRAW_TEXT] = "draw_text",
+    [VIDEO_FUNCTION_DRAW_TEXT_COLORED] = "draw_text_colored",
+    [VIDEO_FUNCTION_DRAW_TEXT_CACHED] = "draw_text_cached",
+    [VIDEO_FUNCTION_APPLY_COLOR_LUT] = "apply_color_lut",
+    [VIDEO_FUNCTION_DRAW_TILE_LAYER] = "draw_tile_layer",
+};
+
+// The host only talks to a single game, which js_* entry points pass to everything else.
+static struct GameContext game_context;
+
+void on_frame_state_pre_load(struct GameContext *game);
+void on_frame_state_loading(struct GameContext *game);
+void on_frame_state_splash(struct GameContext *game);
+void on_frame_state_title(struct GameContext *game);
+void on_frame_state_select(struct GameContext *game);
+void on_frame_state_play(struct GameContext *game);
+void on_frame_state_win(struct GameContext *game);
+void on_frame_state_lose(struct GameContext *game);
+
+void menu_build_images(s32 canvas_width);
+void convert_images_to_indexed(struct VideoPalette *palette);
+void draw_menu_bg(struct GameContext *game);
+s32 layout_get_top(struct GameContext *game);
+void draw_clear(struct GameContext *game, struct Color color);
+void draw_clear_rect(struct GameContext *game, s32 x, s32 y, s32 w, s32 h, struct Color color);
+void draw_overlay(struct GameContext *game, struct Color color);
+void draw_text(struct GameContext *game, const char *str, s32 x, s32 y, enum TextAlign align);
+void draw_text_colored(struct GameContext *game, const char *str, s32 x, s32 y, enum TextAlign align, struct Color color);
+void draw_profiler_overlay(struct GameContext *game);
+bool draw_from_frame_cache(struct GameContext *game, u32 key);
+void frame_cache_store(struct GameContext *game, u32 key);
+struct VideoColorLut *post_process_get_lut(struct PostProcess *post_process, struct Color color);
+void post_process_end_frame(struct GameContext *game);
+enum LevelTileKind level_palette_lookup(u32 pixel);
+bool load_level_from_image(struct Level *level, struct Rng *rng, enum ImageId image_id);
+bool level_add_spike(struct Level *level, s32 tile_x, s32 tile_y, bool is_up_start);
+bool level_add_moving_block(struct Level *level, s32 tile_x, s32 tile_y, s32 y_direction_start);
+void level_prepare_entities(struct Level *level);
+bool level_spike_is_up(struct LevelSpikes *spikes, s32 idx, s32 tick);
+s32 level_moving_block_get_tile_y(struct LevelMovingBlocks *moving_blocks, s32 idx, s32 tick);
+bool level_build_hazards(struct Level *level);
+s32 level_add_hazard_schedule(struct LevelHazards *hazards, u8 period, u8 *bits);
+bool level_is_tile_deadly(struct Level *level, s32 tile_x, s32 tile_y, s32 tick);
+void draw_level(struct GameContext *game);
+bool load_level(struct PlayContext *play, s32 level_idx, u32 rng_seed);
+bool game_load_level(struct GameContext *game, s32 level_idx);
+void reset_level(struct PlayContext *play);
+void restart_level(struct GameContext *game);
+f64 play_time_from_host_time(struct GameContext *game, f64 host_time_ms);
+enum PlayResult play_simulate_event(struct PlayContext *play, struct InputEvent event);
+enum PlayResult play_run_ticks_until(struct PlayContext *play, f64 time_ms);
+f64 play_get_tick_time_ms(struct PlayContext *play, s32 tick);
+void play_tick(struct PlayContext *play);
+enum PlayResult play_check_collisions(struct PlayContext *play);
+void play_on_result(struct GameContext *game, enum PlayResult result);
+void play_capture_snapshot(struct GameContext *game, struct PlaySnapshot *snapshot);
+void play_restore_snapshot(struct GameContext *game, struct PlaySnapshot *snapshot);
+void headless_play_alloc_level(struct GameContext *game);
+void restart_level_from_checkpoint(struct GameContext *game);
+void replay_begin_recording(struct Replay *replay);
+void replay_discard_recording(struct Replay *replay);
+void replay_record_event(struct Replay *replay, struct InputEvent event);
+void replay_end_recording(struct Replay *replay, struct PlayContext *play, enum PlayResult result);
+bool replay_run(struct PlayContext *play, u8 *data, s32 size, enum PlayResult *result, s32 *end_tick);
+bool solve_level(struct Solver *solver, struct PlayContext *play, struct LevelSolution *solution);
+u64 solver_get_safe_rows(struct Level *level, s32 x, s32 tick);
+u64 solver_get_finish_rows(struct Level *level, s32 x);
+void draw_8x8_tile(struct Image *framebuffer, enum ImageId image_id, s32 x, s32 y);
+bool *get_level_wall_at_pos(struct Level *level, s32 x, s32 y);
+s32 get_level_spike_at_pos(struct Level *level, s32 x, s32 y);
+s32 get_level_moving_block_at_pos(struct Level *level, s32 x, s32 y, s32 tick);
+struct LevelEntity *get_level_finish_at_pos(struct Level *level, s32 x, s32 y);
+void profiler_begin_zone(struct Profiler *profiler, enum ProfileZone zone);
+void profiler_end_zone(struct Profiler *profiler, enum ProfileZone zone);
+void profiler_end_frame(struct Profiler *profiler);
+void profiler_get_zone_stats(struct Profiler *profiler, enum ProfileZone zone, f32 *average_ms, f32 *max_ms);
+void profiler_export(struct Profiler *profiler, enum ProfilerExportFormat format, f64 *level_load_time_ms);
+s32 telemetry_get_bucket(u32 time_us);
+u32 telemetry_get_bucket_start_us(s32 bucket);
+void telemetry_record_frame(struct Telemetry *telemetry, f64 duration_ms);
+void telemetry_record_ticks(struct Telemetry *telemetry, s32 tick_count);
+void telemetry_record_audio_drift(struct Telemetry *telemetry, f64 drift_ms);
+s32 telemetry_get_frame_percentile_us(struct Telemetry *telemetry, s32 per_mille);
+void telemetry_summarize(struct Telemetry *telemetry, struct TelemetrySummary *summary);
+void telemetry_save_summary(struct TelemetrySummary *summary);
+void telemetry_save(struct Telemetry *telemetry);
+void telemetry_load_summary(struct TelemetrySummary *summary);
+void telemetry_push_summary_json(struct StrBuf *out, struct TelemetrySummary *summary);
+void telemetry_export(struct Telemetry *telemetry);
+void render_stats_end_frame(struct RenderStats *render_stats, s32 pixel_count);
+void render_stats_export(struct RenderStats *render_stats);
+
+void (*state_on_frame[STATE_ID_COUNT])(struct GameContext *game) = {
     [STATE_ID_PRE_LOAD] = on_frame_state_pre_load,
     [STATE_ID_LOADING] = on_frame_state_loading,
     [STATE_ID_SPLASH] = on_frame_state_splash,
@@ -164,12 +601,17 @@ void (*state_on_frame[STATE_ID_COUNT])(void) = {
     [STATE_ID_LOSE] = on_frame_state_lose,
 };
 
-static struct Level *current_level = NULL;
-static f32 level_beat_len_ms[LEVEL_COUNT] = {
-    BPM_TO_BEAT_LEN_MS(100.f),
-    BPM_TO_BEAT_LEN_MS(120.f),
-    BPM_TO_BEAT_LEN_MS(140.f),
-    BPM_TO_BEAT_LEN_MS(150.f),
+static f64 level_beat_len_ms[LEVEL_COUNT] = {
+    BPM_TO_BEAT_LEN_MS(100.0),
+    BPM_TO_BEAT_LEN_MS(120.0),
+    BPM_TO_BEAT_LEN_MS(140.0),
+    BPM_TO_BEAT_LEN_MS(150.0),
+};
+static enum ImageId level_image[LEVEL_COUNT] = {
+    IMAGE_ID_LEVEL_1,
+    IMAGE_ID_LEVEL_2,
+    IMAGE_ID_LEVEL_3,
+    IMAGE_ID_LEVEL_4,
 };
 static enum ImageId level_wall_image[LEVEL_COUNT] = {
     IMAGE_ID_WALL_1,
@@ -183,25 +625,163 @@ static enum AudioId level_music_audio[LEVEL_COUNT] = {
     AUDIO_ID_LEVEL_3_SONG,
     AUDIO_ID_LEVEL_4_SONG,
 };
-static f32 current_level_beat_len_ms;
-static enum ImageId current_level_wall_image_id;
-static enum AudioId current_level_music_audio_id;
-static s32 player_tile_pos_x;
-static s32 player_tile_pos_y;
-static f32 camera_pos_x;
-static f32 camera_pos_y;
-static s32 level_start_time_ms; // TODO: Remove if unused
-static f32 last_tick_time_ms;
-static s32 player_tick_capacitor;
-static f32 hog_pos = 200.f;
-static s32 hog_timer_start_ms;
-static s32 level_idx_unlocked;
-static s32 splash_timer_start_ms;
 
-void js_on_keyboard_event(s32 ascii_code, s32 new_state)
+// Maps level image colors to tile kinds. Must stay sorted by color.
+static const struct
+{
+    u32 rgb;
+    enum LevelTileKind kind;
+} level_palette[] = {
+    {LEVEL_PALETTE_RGB(0, 0, 0), LEVEL_TILE_KIND_EMPTY},
+    {LEVEL_PALETTE_RGB(138, 107, 0), LEVEL_TILE_KIND_MOVING_BLOCK_DOWN},
+    {LEVEL_PALETTE_RGB(255, 201, 14), LEVEL_TILE_KIND_MOVING_BLOCK_RANDOM},
+    {LEVEL_PALETTE_RGB(36, 123, 21), LEVEL_TILE_KIND_FINISH},
+    {LEVEL_PALETTE_RGB(34, 177, 76), LEVEL_TILE_KIND_PLAYER_START},
+    {LEVEL_PALETTE_RGB(255, 218, 91), LEVEL_TILE_KIND_MOVING_BLOCK_UP},
+    {LEVEL_PALETTE_RGB(127, 127, 127), LEVEL_TILE_KIND_SPIKES},
+    {LEVEL_PALETTE_RGB(195, 195, 195), LEVEL_TILE_KIND_SPIKES_OFF_BEAT},
+    {LEVEL_PALETTE_RGB(255, 255, 255), LEVEL_TILE_KIND_WALL},
+};
+
+void js_on_keyboard_event(s32 key_code, s32 new_state, f64 time_ms)
+{
+    if (key_code < 0 || key_code >= INPUT_KEY_COUNT) return;
+    
+    struct InputEvent event = {
+        .time_ms = time_ms,
+        .key = (u8)key_code,
+        .is_down = new_state != 0,
+    };
+    input_queue_push(&game_context.input_queue, event);
+}
+
+f64 js_get_level_load_time_ms(s32 level_idx)
+{
+    if (level_idx < 0 || level_idx >= LEVEL_COUNT) return 0.0;
+    return game_context.level_load_time_ms[level_idx];
+}
+
+char *js_profiler_export(s32 format)
+{
+    struct Profiler *profiler = &game_context.profiler;
+    if (format < 0 || format >= PROFILER_EXPORT_FORMAT_COUNT) return NULL;
+    
+    profiler_export(profiler, (enum ProfilerExportFormat)format, game_context.level_load_time_ms);
+    return profiler->export_storage;
+}
+
+s32 js_profiler_get_export_length(void)
+{
+    return game_context.profiler.export_length;
+}
+
+char *js_telemetry_export(void)
+{
+    telemetry_export(&game_context.telemetry);
+    return game_context.telemetry.export_storage;
+}
+
+s32 js_telemetry_get_export_length(void)
+{
+    return game_context.telemetry.export_length;
+}
+
+char *js_render_stats_export(void)
+{
+    render_stats_export(&game_context.render_stats);
+    return game_context.render_stats.export_storage;
+}
+
+s32 js_render_stats_get_export_length(void)
+{
+    return game_context.render_stats.export_length;
+}
+
+u8 *js_replay_get_recording(void)
+{
+    return game_context.replay_recording.data;
+}
+
+s32 js_replay_get_recording_size(void)
+{
+    struct Replay *replay = &game_context.replay_recording;
+    return replay->is_recording ? 0 : replay->size;
+}
+
+u8 *js_replay_get_playback_buffer(void)
+{
+    return game_context.replay_playback_data;
+}
+
+s32 js_replay_verify(s32 size)
+{
+    struct GameContext *game = &game_context;
+    
+    if (size < REPLAY_HEADER_SIZE || size > REPLAY_MAX_SIZE) return -1;
+    
+    headless_play_alloc_level(game);
+    
+    enum PlayResult result;
+    s32 end_tick;
+    if (!replay_run(&game->headless_play, game->replay_playback_data, size, &result, &end_tick)) return -1;
+    
+    enum PlayResult recorded_result = (enum PlayResult)game->replay_playback_data[6];
+    s32 recorded_end_tick = (s32)mem_read_u32_le(&game->replay_playback_data[12]);
+    return (result == recorded_result && end_tick == recorded_end_tick) ? 1 : 0;
+}
+
+s32 js_simulate_ticks(s32 tick_count)
+{
+    struct GameContext *game = &game_context;
+    
+    if (game->current_state != STATE_ID_PLAY) return PLAY_RESULT_NONE;
+    
+    enum PlayResult result = PLAY_RESULT_NONE;
+    for (s32 i = 0; i < tick_count && result == PLAY_RESULT_NONE; ++i)
+    {
+        result = play_run_ticks_until(&game->play, play_get_tick_time_ms(&game->play, game->play.tick_count + 1));
+    }
+    
+    // Move the level clock and the music forward to match.
+    f64 tick_time_ms = play_get_tick_time_ms(&game->play, game->play.tick_count);
+    game->level_start_time_ms = js_get_time_ms() - tick_time_ms;
+    game->level_simulated_time_ms = tick_time_ms;
+    js_audio_set_time(audio[game->level_music_audio_id], tick_time_ms);
+    
+    if (result != PLAY_RESULT_NONE) play_on_result(game, result);
+    return result;
+}
+
+s32 js_solve_level(s32 level_idx, u32 rng_seed)
+{
+    struct GameContext *game = &game_context;
+    
+    if (level_idx < 0 || level_idx >= LEVEL_COUNT) return -1;
+    if (game->current_state == STATE_ID_PRE_LOAD || game->current_state == STATE_ID_LOADING) return -1;
+    
+    headless_play_alloc_level(game);
+    
+    f64 solve_start_time_ms = js_get_time_ms();
+    if (!load_level(&game->headless_play, level_idx, rng_seed)) return -1;
+    bool is_solvable = solve_level(&game->solver, &game->headless_play, &game->solution);
+    game->solution.solve_time_ms = js_get_time_ms() - solve_start_time_ms;
+    
+    return is_solvable ? 1 : 0;
+}
+
+f64 js_solver_get_winning_path_count(void)
+{
+    return (f64)game_context.solution.winning_path_count;
+}
+
+f64 js_solver_get_reaction_window_ms(void)
+{
+    return (f64)game_context.solution.reaction_window_ms;
+}
+
+f64 js_solver_get_solve_time_ms(void)
 {
-    if (keyboard_state[ascii_code] == 0 && new_state == 1) keyboard_state[ascii_code] = 2;
-    else keyboard_state[ascii_code] = new_state;
+    return game_context.solution.solve_time_ms;
 }
 
 void *js_on_image_loaded(s32 id, s32 width, s32 height)
@@ -213,19 +793,68 @@ void *js_on_image_loaded(s32 id, s32 width, s32 height)
     return image[id].data;
 }
 
+void js_on_image_ready(s32 id)
+{
+    image_premultiply_alpha(&image[id]);
+}
+
 void js_on_startup(void)
 {
-    rng_set_seed(js_get_unix_time());
+    struct GameContext *game = &game_context;
+    
+    game->current_state = STATE_ID_PRE_LOAD;
+    game->last_frame_state = STATE_ID_COUNT;
+    
+    strbuf_init(&game->strbuf, game->strbuf_storage, countof(game->strbuf_storage));
+    
+    rng_set_seed(&game->rng, js_get_unix_time());
+    
+    game->hog_pos = 200.f;
+    game->is_title_text_visible = true;
+    
+    telemetry_load_summary(&game->telemetry.previous_session);
+    
+    game->level_idx_unlocked = js_localstore_get_s32("squares_progres");
+    game->level_idx_unlocked = 500;
+    
+    // Everything else is sized from the framebuffer.
+    s32 resolution_idx = js_localstore_get_s32("squares_resolution");
+    if (resolution_idx < 0 || resolution_idx >= (s32)countof(canvas_resolutions)) resolution_idx = 0;
+    const struct CanvasResolution *resolution = &canvas_resolutions[resolution_idx];
+    js_canvas_resize(resolution->width, resolution->height, resolution->scale);
+    
+    game->framebuffer.width = resolution->width;
+    game->framebuffer.height = resolution->height;
+    game->framebuffer.dirty_rects = &game->framebuffer_dirty_rects;
+#if INDEXED_COLOR
+    video_palette_init(&game->palette);
+    game->framebuffer.format = IMAGE_FORMAT_INDEXED;
+    game->framebuffer.palette = &game->palette;
+    
+    game->present_buffer.width = resolution->width;
+    game->present_buffer.height = resolution->height;
+    game->present_buffer.data = mem_alloc(image_calculate_size(&game->present_buffer));
+    js_set_framebuffer(game->present_buffer.data);
+#endif
+    game->framebuffer.data = mem_alloc(image_calculate_size(&game->framebuffer));
+#if !INDEXED_COLOR
+    js_set_framebuffer(game->framebuffer.data);
+#endif
     
-    level_idx_unlocked = js_localstore_get_s32("squares_progres");
-    level_idx_unlocked = 500;
+    game->frame_cache.image.width = resolution->width;
+    game->frame_cache.image.height = resolution->height;
+    game->frame_cache.image.format = game->framebuffer.format;
+    game->frame_cache.image.palette = game->framebuffer.palette;
+    game->frame_cache.image.data = mem_alloc(image_calculate_size(&game->frame_cache.image));
     
-    js_canvas_resize(CANVAS_WIDTH, CANVAS_HEIGHT, CANVAS_SCALE);
+    // A partly visible column at either side of the screen.
+    game->level_layer_tiles = mem_alloc((resolution->width / 8 + 2) * LEVEL_MAX_HEIGHT);
     
-    framebuffer.data = mem_alloc(CANVAS_WIDTH * CANVAS_HEIGHT * 4);
-    framebuffer.width = CANVAS_WIDTH;
-    framebuffer.height = CANVAS_HEIGHT;
-    js_set_framebuffer(framebuffer.data);
+#if VIDEO_COUNT_STATS
+    game->render_stats.frame.overdraw = mem_alloc(game->framebuffer.width * game->framebuffer.height);
+    video_stats_clear(&game->render_stats.frame, game->framebuffer.width * game->framebuffer.height);
+    game->framebuffer.stats = &game->render_stats.frame;
+#endif
     
     // Set up font structs.
     font[FONT_ID_SMALL] = (struct ImageAsciiMonospacedFont) {
@@ -238,31 +867,87 @@ void js_on_startup(void)
     js_asset_load_image("assets/font_6x8.png", IMAGE_ID_FONT_SMALL);
     
     // Allocate space for levels.
-    current_level = mem_alloc(sizeof(*current_level));
-    mem_set_u8((void*)current_level, sizeof(*current_level), 0);
+    game->play.level = mem_alloc(sizeof(*game->play.level));
+    mem_set_u8((void*)game->play.level, sizeof(*game->play.level), 0);
 }
 
 void js_on_frame(void)
 {
-    s32 frame_start_time_ms = js_get_time_ms();
+    struct GameContext *game = &game_context;
+    
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_FRAME);
+    
+    f64 frame_start_time_ms = js_get_time_ms();
+    
+    game->delta_time_s = (f32)((frame_start_time_ms - game->last_frame_start_time_ms) / 1000.0);
+    game->last_frame_start_time_ms = frame_start_time_ms;
+    
+    input_begin_frame(&game->input, &game->input_queue);
+    
+    bool is_overlay_toggled = input_was_pressed(&game->input, JS_KEY_CODE_BACKQUOTE);
+    if (is_overlay_toggled) game->profiler.is_overlay_visible = !game->profiler.is_overlay_visible;
     
-    delta_time_s = (f32)(frame_start_time_ms - last_frame_start_time_ms) / 1000.f;
-    last_frame_start_time_ms = frame_start_time_ms;
+#if VIDEO_COUNT_STATS
+    bool is_heatmap_toggled = input_was_pressed(&game->input, JS_KEY_CODE_O);
+    if (is_heatmap_toggled) game->render_stats.is_heatmap_visible = !game->render_stats.is_heatmap_visible;
+    is_overlay_toggled = is_overlay_toggled || is_heatmap_toggled;
+#endif
+    
+    // The heatmap replaces the whole frame, so it can't be partly redrawn on top of.
+    enum StateId state = game->current_state;
+    game->is_full_redraw_needed = (state != game->last_frame_state) || is_overlay_toggled ||
+        game->profiler.is_overlay_visible || game->render_stats.is_heatmap_visible || game->post_process.was_applied;
+    if (state != game->last_frame_state) game->frame_cache.is_valid = false;
+    game->post_process.color.a = 0;
+    state_on_frame[state](game);
+    game->last_frame_state = state;
+    post_process_end_frame(game);
+    
+    if (game->profiler.is_overlay_visible) draw_profiler_overlay(game);
+    
+#if VIDEO_COUNT_STATS
+    render_stats_end_frame(&game->render_stats, game->framebuffer.width * game->framebuffer.height);
+    if (game->render_stats.is_heatmap_visible) video_draw_overdraw_heatmap(&game->framebuffer);
+    video_stats_clear(&game->render_stats.frame, game->framebuffer.width * game->framebuffer.height);
+#endif
     
-    state_on_frame[current_state]();
+    // Present only the rows that were drawn to.
+    s32 first_dirty_row;
+    s32 dirty_row_count;
+    if (video_dirty_rects_get_row_range(&game->framebuffer_dirty_rects, &first_dirty_row, &dirty_row_count))
+    {
+        profiler_begin_zone(&game->profiler, PROFILE_ZONE_PRESENT);
+#if INDEXED_COLOR
+        video_expand_indexed_rows(&game->present_buffer, &game->framebuffer, first_dirty_row, dirty_row_count);
+#endif
+        js_present_rows(first_dirty_row, dirty_row_count);
+        profiler_end_zone(&game->profiler, PROFILE_ZONE_PRESENT);
+    }
+    video_dirty_rects_clear(&game->framebuffer_dirty_rects);
     
-    last_frame_duration_ms = js_get_time_ms() - frame_start_time_ms;
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_FRAME);
+    profiler_end_frame(&game->profiler);
     
-    for (int i = 0; i < 256; ++i) if (keyboard_state[i] == 2) keyboard_state[i] = 1;
+    telemetry_record_frame(&game->telemetry, js_get_time_ms() - frame_start_time_ms);
+}
+
+void js_on_page_hide(void)
+{
+    telemetry_save(&game_context.telemetry);
 }
 
-void on_frame_state_pre_load(void)
+void on_frame_state_pre_load(struct GameContext *game)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
+    if (game->is_full_redraw_needed) draw_clear(game, video_make_color(0, 0, 0));
     
     // Wait until assets required for the loading screen have been loaded.
     if (js_asset_count_loaded() == 1)
     {
+        font_build_glyph_masks(&font[FONT_ID_SMALL]);
+#if INDEXED_COLOR
+        image_convert_to_indexed(&image[IMAGE_ID_FONT_SMALL], &game->palette);
+#endif
+        
         // Begin async loading of all remaining assets.
         js_asset_load_image("assets/test_level.png", IMAGE_ID_TEST_LEVEL);
         js_asset_load_image("assets/menu_bg.png", IMAGE_ID_MENU_BG);
@@ -291,89 +976,103 @@ void on_frame_state_pre_load(void)
         audio[AUDIO_ID_SPLASH] = js_asset_load_audio("assets/splash.ogg");
         audio[AUDIO_ID_FAIL] = js_asset_load_audio("assets/fail.ogg");
         
-        current_state = STATE_ID_LOADING;
+        game->current_state = STATE_ID_LOADING;
     }
 }
 
-void on_frame_state_loading(void)
+void on_frame_state_loading(struct GameContext *game)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
-    
     // Wait for all assets to load.
     s32 asset_target = IMAGE_ID_COUNT + AUDIO_ID_COUNT;
     s32 asset_count = js_asset_count_loaded();
+    s32 percent = (s32)(((f32)asset_count / (f32)asset_target) * 100.f);
+    s32 top = layout_get_top(game);
     
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "LOADING...", CANVAS_WIDTH / 2, 16, TEXT_ALIGN_CENTER);
+    // Only the percentage changes, so everything else is drawn once.
+    if (game->is_full_redraw_needed)
+    {
+        draw_clear(game, video_make_color(0, 0, 0));
+        draw_text(game, "LOADING...", game->framebuffer.width / 2, top + 16, TEXT_ALIGN_CENTER);
+        game->loading_drawn_percent = -1;
+    }
     
-    strbuf_clear();
-    strbuf_push_s32((s32)(((f32)asset_count / (f32)asset_target) * 100.f));
-    strbuf_push_string("%");
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], strbuf_get(), CANVAS_WIDTH / 2, 16 + 8, TEXT_ALIGN_CENTER);
+    if (percent != game->loading_drawn_percent)
+    {
+        game->loading_drawn_percent = percent;
+        
+        draw_clear_rect(game, 0, top + 16 + 8, game->framebuffer.width, 8, video_make_color(0, 0, 0));
+        strbuf_clear(&game->strbuf);
+        strbuf_printf(&game->strbuf, "%d%%", percent);
+        draw_text(game, strbuf_get(&game->strbuf), game->framebuffer.width / 2, top + 16 + 8, TEXT_ALIGN_CENTER);
+        
+        if (asset_count == asset_target)
+        {
+            draw_text(game, "Press any", game->framebuffer.width / 2, top + 40, TEXT_ALIGN_CENTER);
+            draw_text(game, "key", game->framebuffer.width / 2, top + 48, TEXT_ALIGN_CENTER);
+        }
+    }
     
     if (asset_count == asset_target)
     {
-        video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "Press any", CANVAS_WIDTH / 2, 40, TEXT_ALIGN_CENTER);
-        video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "key", CANVAS_WIDTH / 2, 48, TEXT_ALIGN_CENTER);
-        
         // Wait for any key to be pressed.
-        for (int i = 0; i < countof(keyboard_state); ++i)
+        if (input_any_was_pressed(&game->input))
         {
-            if (keyboard_state[i] == 2)
-            {
-                current_state = STATE_ID_SPLASH;
-                splash_timer_start_ms = js_get_time_ms();
-            }
+            menu_build_images(game->framebuffer.width);
+#if INDEXED_COLOR
+            convert_images_to_indexed(&game->palette);
+#endif
+            game->current_state = STATE_ID_SPLASH;
+            game->splash_timer_start_ms = js_get_time_ms();
         }
     }
 }
 
-void on_frame_state_splash(void)
+void on_frame_state_splash(struct GameContext *game)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(8, 20, 30));
+    f64 splash_time_ms = js_get_time_ms() - game->splash_timer_start_ms;
+    bool is_dimmed = splash_time_ms < 500;
     
-    video_blit(
-        &framebuffer,
-        &image[IMAGE_ID_YYAM],
-        17,
-        28,
-        0,
-        0,
-        30,
-        7,
-        BLIT_FLIP_NONE);
-    
-    static bool has_played_sound = false;
-    s32 splash_time_ms = js_get_time_ms() - splash_timer_start_ms;
-    
-    if (splash_time_ms < 500)
+    // The dimming is done after the screen is drawn, so the screen itself never changes.
+    if (!draw_from_frame_cache(game, 0))
     {
-        struct Color overlay_color = {0, 0, 0, 194};
-        video_draw_rect(&framebuffer, 0, 0, 64, 64, overlay_color);
+        draw_clear(game, video_make_color(8, 20, 30));
+        
+        video_blit(
+            &game->framebuffer,
+            &image[IMAGE_ID_YYAM],
+            (game->framebuffer.width - 30) / 2,
+            (game->framebuffer.height - 7) / 2,
+            0,
+            0,
+            30,
+            7,
+            BLIT_FLIP_NONE);
+        
+        frame_cache_store(game, 0);
     }
     
-    if (splash_time_ms > 500 && !has_played_sound)
+    if (is_dimmed) game->post_process.color = (struct Color) {0, 0, 0, 194};
+    
+    if (splash_time_ms > 500 && !game->has_played_splash_sound)
     {
-        has_played_sound = true;
+        game->has_played_splash_sound = true;
         js_audio_play(audio[AUDIO_ID_SPLASH]);
     }
     
     if (splash_time_ms > 3000)
     {
-        current_state = STATE_ID_TITLE;
-        hog_timer_start_ms = js_get_time_ms();
+        game->current_state = STATE_ID_TITLE;
+        game->hog_timer_start_ms = js_get_time_ms();
         js_audio_stop(audio[AUDIO_ID_SPLASH]);
         js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
     }
     
-    for (int i = 0; i < countof(keyboard_state); ++i)
+    if (input_any_was_pressed(&game->input))
     {
-        if (keyboard_state[i] == 2)
-        {
-            current_state = STATE_ID_TITLE;
-            hog_timer_start_ms = js_get_time_ms();
-            js_audio_stop(audio[AUDIO_ID_SPLASH]);
-            js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
-        }
+        game->current_state = STATE_ID_TITLE;
+        game->hog_timer_start_ms = js_get_time_ms();
+        js_audio_stop(audio[AUDIO_ID_SPLASH]);
+        js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
     }
 }
 
@@ -383,543 +1082,1511 @@ static s32 letter_get_pos(f32 angle)
     return (s32)(12.f + (math_sin(angle) * 8.f));
 }
 
-void on_frame_state_title(void)
+void on_frame_state_title(struct GameContext *game)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
-    
     // Easter egg.
-    if (js_get_time_ms() - hog_timer_start_ms > 15000)
+    if (js_get_time_ms() - game->hog_timer_start_ms > 15000)
     {
-        hog_timer_start_ms = js_get_time_ms();
-        hog_pos = -30.f;
+        game->hog_timer_start_ms = js_get_time_ms();
+        game->hog_pos = -30.f;
     }
     
-    draw_menu_bg();
+    draw_menu_bg(game);
     
     // Draw wavey text.
+    s32 top = layout_get_top(game);
     const s32 spacing = 9;
-    const s32 x_offset = 1;
+    const s32 x_offset = (game->framebuffer.width - spacing * 7) / 2 + 1;
     const f32 ang_space = .7f;
-    static f32 ang = 0.f;
-    ang += 5.f * delta_time_s;
+    game->title_angle = math_mod_f32(game->title_angle + 5.f * game->delta_time_s, MATH_TAU); // Keep the angle bounded so precision doesn't degrade.
+    f32 ang = game->title_angle;
     
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "S", x_offset + spacing * 0, letter_get_pos(ang + 0 * ang_space), TEXT_ALIGN_LEFT);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "Q", x_offset + spacing * 1, letter_get_pos(ang + 1 * ang_space), TEXT_ALIGN_LEFT);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "U", x_offset + spacing * 2, letter_get_pos(ang + 2 * ang_space), TEXT_ALIGN_LEFT);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "A", x_offset + spacing * 3, letter_get_pos(ang + 3 * ang_space), TEXT_ALIGN_LEFT);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "R", x_offset + spacing * 4, letter_get_pos(ang + 4 * ang_space), TEXT_ALIGN_LEFT);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "E", x_offset + spacing * 5, letter_get_pos(ang + 5 * ang_space), TEXT_ALIGN_LEFT);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "S", x_offset + spacing * 6, letter_get_pos(ang + 6 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "S", x_offset + spacing * 0, top + letter_get_pos(ang + 0 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "Q", x_offset + spacing * 1, top + letter_get_pos(ang + 1 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "U", x_offset + spacing * 2, top + letter_get_pos(ang + 2 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "A", x_offset + spacing * 3, top + letter_get_pos(ang + 3 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "R", x_offset + spacing * 4, top + letter_get_pos(ang + 4 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "E", x_offset + spacing * 5, top + letter_get_pos(ang + 5 * ang_space), TEXT_ALIGN_LEFT);
+    draw_text(game, "S", x_offset + spacing * 6, top + letter_get_pos(ang + 6 * ang_space), TEXT_ALIGN_LEFT);
     
     // Draw flashing text.
-    static bool is_text_visible = true;
-    static float time_capacitor_s = 0.f;
-    time_capacitor_s += delta_time_s;
-    if (time_capacitor_s > 0.5f)
+    game->title_text_time_capacitor_s += game->delta_time_s;
+    if (game->title_text_time_capacitor_s > 0.5f)
     {
-        time_capacitor_s -= 0.5f;
-        is_text_visible = !is_text_visible;
+        game->title_text_time_capacitor_s -= 0.5f;
+        game->is_title_text_visible = !game->is_title_text_visible;
     }
-    if (is_text_visible)
+    if (game->is_title_text_visible)
     {
-        video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "Press any", CANVAS_WIDTH / 2, 40, TEXT_ALIGN_CENTER);
-        video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "key", CANVAS_WIDTH / 2, 48, TEXT_ALIGN_CENTER);
+        draw_text(game, "Press any", game->framebuffer.width / 2, top + 40, TEXT_ALIGN_CENTER);
+        draw_text(game, "key", game->framebuffer.width / 2, top + 48, TEXT_ALIGN_CENTER);
     }
     
     // Wait for any key to be pressed.
-    for (int i = 0; i < countof(keyboard_state); ++i)
+    if (input_any_was_pressed(&game->input))
     {
-        if (keyboard_state[i] == 2)
-        {
-            current_state = STATE_ID_SELECT;
-        }
+        game->current_state = STATE_ID_SELECT;
     }
 }
 
-void on_frame_state_select(void)
+void on_frame_state_select(struct GameContext *game)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
+    draw_menu_bg(game);
     
-    draw_menu_bg();
+    s32 level_idx = game->selected_level_idx;
+    s32 top = layout_get_top(game);
     
-    static s32 level_idx = 0;
-    
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "SELECT", CANVAS_WIDTH / 2, 4, TEXT_ALIGN_CENTER);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "STAGE", CANVAS_WIDTH / 2, 4 + 8, TEXT_ALIGN_CENTER);
-    if (level_idx > level_idx_unlocked)
+    draw_text(game, "SELECT", game->framebuffer.width / 2, top + 4, TEXT_ALIGN_CENTER);
+    draw_text(game, "STAGE", game->framebuffer.width / 2, top + 4 + 8, TEXT_ALIGN_CENTER);
+    if (level_idx > game->level_idx_unlocked)
+    {
+        draw_text(game, "LOCKED", game->framebuffer.width / 2, top + LAYOUT_HEIGHT - 12, TEXT_ALIGN_CENTER);
+    }
+    else if (game->is_practice_mode)
     {
-        video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "LOCKED", CANVAS_WIDTH / 2, CANVAS_HEIGHT - 12, TEXT_ALIGN_CENTER);
+        draw_text_colored(game, "PRACTICE", game->framebuffer.width / 2, top + LAYOUT_HEIGHT - 12, TEXT_ALIGN_CENTER, video_make_color(60, 200, 90));
     }
     
-    strbuf_clear();
-    strbuf_push_string("< ");
-    strbuf_push_s32(level_idx + 1);
-    strbuf_push_string(" >");
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], strbuf_get(), CANVAS_WIDTH / 2, TEXT_Y_MIDDLE + 8, TEXT_ALIGN_CENTER);
+    strbuf_clear(&game->strbuf);
+    strbuf_printf(&game->strbuf, "< %d >", level_idx + 1);
+    draw_text(game, strbuf_get(&game->strbuf), game->framebuffer.width / 2, top + LAYOUT_HEIGHT / 2 + 4, TEXT_ALIGN_CENTER);
     
-    if (keyboard_state[37] == 2 && level_idx > 0) level_idx -= 1;
-    if (keyboard_state[39] == 2 && level_idx < LEVEL_COUNT - 1) level_idx += 1;
+    if (input_was_pressed(&game->input, JS_KEY_CODE_LEFT) && level_idx > 0) level_idx -= 1;
+    if (input_was_pressed(&game->input, JS_KEY_CODE_RIGHT) && level_idx < LEVEL_COUNT - 1) level_idx += 1;
+    if (input_was_pressed(&game->input, JS_KEY_CODE_P)) game->is_practice_mode = !game->is_practice_mode;
+    game->selected_level_idx = level_idx;
     
-    if (keyboard_state[13] == 2 && level_idx <= level_idx_unlocked)
+    if (input_was_pressed(&game->input, JS_KEY_CODE_ENTER) && level_idx <= game->level_idx_unlocked)
     {
-        current_state = STATE_ID_PLAY;
+        game->current_state = STATE_ID_PLAY;
         js_audio_stop(audio[AUDIO_ID_TITLE_SONG]);
-        enum ImageId level_image_id;
-        if (level_idx == 0) level_image_id = IMAGE_ID_LEVEL_1;
-        else if (level_idx == 1) level_image_id = IMAGE_ID_LEVEL_2;
-        else if (level_idx == 2) level_image_id = IMAGE_ID_LEVEL_3;
-        else if (level_idx == 3) level_image_id = IMAGE_ID_LEVEL_4;
-        else ASSERT(false);
-        current_level_beat_len_ms = level_beat_len_ms[level_idx];
-        current_level_wall_image_id = level_wall_image[level_idx];
-        current_level_music_audio_id = level_music_audio[level_idx];
-        bool success = load_level_from_image(level_image_id);
+        bool success = game_load_level(game, level_idx);
         ASSERT(success);
-        restart_level();
+        restart_level(game);
     }
 }
 
-void on_frame_state_play(void)
+void on_frame_state_play(struct GameContext *game)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
+    draw_clear(game, video_make_color(0, 0, 0));
     
-    s32 time_now_ms = js_get_time_ms();
-    //s32 time_now_ms = js_audio_get_time(audio[AUDIO_ID_LEVEL_1_SONG]);
+    f64 time_now_ms = js_get_time_ms();
+    //f64 time_now_ms = js_audio_get_time(audio[AUDIO_ID_LEVEL_1_SONG]);
     
     // Handle quitting to menu.
-    if (keyboard_state[27] == 2)
+    if (input_was_pressed(&game->input, JS_KEY_CODE_ESCAPE))
     {
-        current_state = STATE_ID_SELECT;
+        game->current_state = STATE_ID_SELECT;
         js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
-        js_audio_stop(audio[current_level_music_audio_id]);
+        js_audio_stop(audio[game->level_music_audio_id]);
+        replay_end_recording(&game->replay_recording, &game->play, PLAY_RESULT_NONE);
+        telemetry_save(&game->telemetry);
         return;
     }
     
-    // Handle player collisions with entities.
-    s32 player_tile_idx = player_tile_pos_y * current_level->width + player_tile_pos_x;
-    struct LevelEntity *finish = get_level_finish_at_pos(player_tile_pos_x, player_tile_pos_y);
-    struct LevelSpike *spikes = get_level_spike_at_pos(player_tile_pos_x, player_tile_pos_y);
-    struct LevelMovingBlock *moving_block = get_level_moving_block_at_pos(player_tile_pos_x, player_tile_pos_y);
-    if (current_level->walls[player_tile_idx] || (spikes != NULL && spikes->is_up) || moving_block != NULL)
+    // Apply this frame's input and the ticks due in between in the order they happened, so that
+    // input is resolved against the tick it was pressed in rather than the one the frame landed on.
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_SIMULATION);
+    s32 tick_count_before = game->play.tick_count;
+    enum PlayResult result = play_check_collisions(&game->play);
+    for (s32 i = 0; i < game->input.frame_event_count && result == PLAY_RESULT_NONE; ++i)
     {
-        if (!GOD_MODE)
-        {
-            current_state = STATE_ID_LOSE;
-            js_audio_stop(audio[current_level_music_audio_id]);
-            js_audio_play(audio[AUDIO_ID_FAIL]);
-            return;
-        }
+        struct InputEvent event = game->input.frame_events[i];
+        event.time_ms = play_time_from_host_time(game, event.time_ms);
+        
+        // Events can be stamped before ticks that already ran on an earlier frame. They're applied on
+        // the current tick, so record the time they were really applied at for replays to match.
+        if (event.time_ms < game->level_simulated_time_ms) event.time_ms = game->level_simulated_time_ms;
+        game->level_simulated_time_ms = event.time_ms;
+        
+        replay_record_event(&game->replay_recording, event);
+        result = play_simulate_event(&game->play, event);
     }
-    if (finish != NULL)
+    f64 play_time_now_ms = play_time_from_host_time(game, time_now_ms);
+    if (play_time_now_ms > game->level_simulated_time_ms) game->level_simulated_time_ms = play_time_now_ms;
+    if (result == PLAY_RESULT_NONE) result = play_run_ticks_until(&game->play, game->level_simulated_time_ms);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_SIMULATION);
+    telemetry_record_ticks(&game->telemetry, game->play.tick_count - tick_count_before);
+    
+    if (result != PLAY_RESULT_NONE)
     {
-        current_state = STATE_ID_WIN;
-        level_idx_unlocked += 1;
-        js_localstore_set_s32("squares_progress", level_idx_unlocked);
+        play_on_result(game, result);
         return;
     }
     
-    // Handle ticks.
-    f32 next_tick_time_ms = last_tick_time_ms + (current_level_beat_len_ms / 4.f);
-    if ((f32)time_now_ms >= next_tick_time_ms)
+    // The music is started at the same time as the level clock, so any difference is drift.
+    // Before the music starts playing its time stays at 0.
+    f64 music_time_ms = js_audio_get_time(audio[game->level_music_audio_id]);
+    if (music_time_ms > 0.0) telemetry_record_audio_drift(&game->telemetry, music_time_ms - play_time_from_host_time(game, time_now_ms));
+    
+    // Save a checkpoint every few beats in practice mode.
+    s32 checkpoint_ticks = PRACTICE_CHECKPOINT_BEATS * 4;
+    if (game->is_practice_mode &&
+        game->play.tick_count / checkpoint_ticks > game->practice_checkpoint.play_tick_count / checkpoint_ticks)
     {
-        last_tick_time_ms = next_tick_time_ms;
-        
-        player_tick_capacitor += 1;
-        for (int i = 0; i < current_level->finish_count; ++i) current_level->finish[i].tick_capacitor += 1;
-        for (int i = 0; i < current_level->spikes_count; ++i) current_level->spikes[i].entity.tick_capacitor += 1;
-        for (int i = 0; i < current_level->moving_blocks_count; ++i) current_level->moving_blocks[i].entity.tick_capacitor += 1;
+        play_capture_snapshot(game, &game->practice_checkpoint);
+        game->has_practice_checkpoint = true;
     }
     
-    // Handle player movement.
-    if ((!SPACE_TO_MOVE && player_tick_capacitor >= 4) ||
-        (SPACE_TO_MOVE && keyboard_state[32] == 2))
-    {
-#if PLAY_COWBELL
-        js_audio_play(audio[AUDIO_ID_COWBELL]);
+    draw_level(game);
+    
+#if PLAY_BEAT_FLASH
+    // Flash on each beat, fading out over the first quarter of it.
+    f32 beat_phase = math_mod_f32((f32)(play_time_from_host_time(game, time_now_ms) / game->play.beat_len_ms), 1.f);
+    if (beat_phase < .25f) game->post_process.color = (struct Color) {255, 255, 255, (u8)(64.f * (1.f - beat_phase * 4.f))};
 #endif
-        player_tile_pos_x += 1;
-        player_tick_capacitor = 0;
+    
+    // Move camera towards centering on the player.
+    f32 camera_target_x = (f32)((game->play.player_tile_pos_x * 8) - (game->framebuffer.width / 2 - 4));
+    f32 camera_target_y = (f32)((game->play.player_tile_pos_y * 8) - (game->framebuffer.height / 2 - 4));
+    f32 camera_delta_x = camera_target_x - game->camera_pos_x;
+    f32 camera_delta_y = camera_target_y - game->camera_pos_y;
+    game->camera_pos_x += camera_delta_x * .25f;
+    game->camera_pos_y += camera_delta_y * .25f;
+}
+
+void on_frame_state_win(struct GameContext *game)
+{
+    // The level is frozen on the tick it was won on, so the screen is only drawn once.
+    if (!draw_from_frame_cache(game, 0))
+    {
+        draw_clear(game, video_make_color(0, 0, 0));
+        
+        draw_level(game);
+        
+        struct Color overlay_color = {0, 0, 0, 196};
+        draw_overlay(game, overlay_color);
+        
+        s32 top = layout_get_top(game);
+        draw_text(game, "LEVEL", game->framebuffer.width / 2, top + 4, TEXT_ALIGN_CENTER);
+        draw_text(game, "COMPLETE", game->framebuffer.width / 2, top + 4 + 8, TEXT_ALIGN_CENTER);
+        draw_text(game, "ESC: Menu", game->framebuffer.width / 2, top + 4 + 32, TEXT_ALIGN_CENTER);
+        
+        frame_cache_store(game, 0);
     }
-    if (keyboard_state[38] == 2) player_tile_pos_y -= 1;
-    if (keyboard_state[40] == 2) player_tile_pos_y += 1;
     
-    // Handle moving blocks.
-    for (int i = 0; i < current_level->moving_blocks_count; ++i)
+    if (input_was_pressed(&game->input, JS_KEY_CODE_ESCAPE))
     {
-        if (current_level->moving_blocks[i].entity.tick_capacitor >= 4)
-        {
-            current_level->moving_blocks[i].entity.tick_capacitor -= 4;
-            
-            bool *wall = get_level_wall_at_pos(
-                current_level->moving_blocks[i].entity.tile_x,
-                current_level->moving_blocks[i].entity.tile_y + current_level->moving_blocks[i].y_direction);
-            
-            if (wall != NULL) current_level->moving_blocks[i].y_direction = -current_level->moving_blocks[i].y_direction;
-            
-            wall = get_level_wall_at_pos(
-                current_level->moving_blocks[i].entity.tile_x,
-                current_level->moving_blocks[i].entity.tile_y + current_level->moving_blocks[i].y_direction);
-            
-            if (wall == NULL) current_level->moving_blocks[i].entity.tile_y += current_level->moving_blocks[i].y_direction;
-        }
+        game->current_state = STATE_ID_SELECT;
+        js_audio_stop(audio[game->level_music_audio_id]);
+        js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
+    }
+}
+
+void on_frame_state_lose(struct GameContext *game)
+{
+    if (!draw_from_frame_cache(game, 0))
+    {
+        draw_clear(game, video_make_color(0, 0, 0));
+        
+        draw_level(game);
+        
+        struct Color overlay_color = {0, 0, 0, 196};
+        draw_overlay(game, overlay_color);
+        
+        s32 top = layout_get_top(game);
+        draw_text(game, "GAME OVER", game->framebuffer.width / 2, top + 4, TEXT_ALIGN_CENTER);
+        draw_text(game, "RTN: Again", game->framebuffer.width / 2, top + 4 + 24, TEXT_ALIGN_CENTER);
+        draw_text(game, "ESC: Menu", game->framebuffer.width / 2, top + 4 + 24 + 9, TEXT_ALIGN_CENTER);
+        
+        frame_cache_store(game, 0);
     }
     
-    // Handle spikes.
-    for (int i = 0; i < current_level->spikes_count; ++i)
+    if (input_was_pressed(&game->input, JS_KEY_CODE_ENTER))
     {
-        if (current_level->spikes[i].entity.tick_capacitor >= 4)
-        {
-            current_level->spikes[i].entity.tick_capacitor -= 4;
-            current_level->spikes[i].is_up = !current_level->spikes[i].is_up;
-        }
+        game->current_state = STATE_ID_PLAY;
+        if (game->is_practice_mode && game->has_practice_checkpoint) restart_level_from_checkpoint(game);
+        else restart_level(game);
     }
     
-    draw_level();
+    if (input_was_pressed(&game->input, JS_KEY_CODE_ESCAPE))
+    {
+        js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
+        game->current_state = STATE_ID_SELECT;
+    }
+}
+
+enum LevelTileKind level_palette_lookup(u32 pixel)
+{
+    u32 rgb = pixel & LEVEL_PALETTE_RGB_MASK;
     
-    // Move camera towards centering on the player.
-    f32 camera_target_x = (f32)((player_tile_pos_x * 8) - (CANVAS_WIDTH / 2 - 4));
-    f32 camera_target_y = (f32)((player_tile_pos_y * 8) - (CANVAS_HEIGHT / 2 - 4));
-    f32 camera_delta_x = camera_target_x - camera_pos_x;
-    f32 camera_delta_y = camera_target_y - camera_pos_y;
-    camera_pos_x += camera_delta_x * .25f;
-    camera_pos_y += camera_delta_y * .25f;
+    s32 low = 0;
+    s32 high = countof(level_palette) - 1;
+    while (low <= high)
+    {
+        s32 mid = (low + high) / 2;
+        if (level_palette[mid].rgb == rgb) return level_palette[mid].kind;
+        if (level_palette[mid].rgb < rgb) low = mid + 1;
+        else high = mid - 1;
+    }
+    
+    return LEVEL_TILE_KIND_INVALID;
 }
 
-void on_frame_state_win(void)
+bool load_level_from_image(struct Level *level, struct Rng *rng, enum ImageId image_id)
 {
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
+    level->width = image[image_id].width;
+    level->height = image[image_id].height;
+    
+    if (level->width > LEVEL_MAX_WIDTH ||
+        level->height > LEVEL_MAX_HEIGHT)
+    {
+        char message_storage[128];
+        struct StrBuf message;
+        strbuf_init(&message, message_storage, countof(message_storage));
+        strbuf_printf(&message, "Error loading level with image id %d. Level dimensions are too big!", image_id);
+        js_show_alert(strbuf_get(&message));
+        return false;
+    }
     
-    draw_level();
+    u32 *pixels = (u32 *)image[image_id].data;
     
-    struct Color overlay_color = {0, 0, 0, 196};
-    video_draw_rect(&framebuffer, 0, 0, CANVAS_WIDTH, CANVAS_HEIGHT, overlay_color);
+    level->finish_count = 0;
+    level->spikes.count = 0;
+    level->moving_blocks.count = 0;
     
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "LEVEL", CANVAS_WIDTH / 2, 4, TEXT_ALIGN_CENTER);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "COMPLETE", CANVAS_WIDTH / 2, 4 + 8, TEXT_ALIGN_CENTER);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "ESC: Menu", CANVAS_WIDTH / 2, 4 + 32, TEXT_ALIGN_CENTER);
+    mem_set_u8((void *)level->walls, countof(level->walls), 0);
     
-    if (keyboard_state[27] == 2)
+    for (s32 tile_y = 0; tile_y < level->height; ++tile_y)
     {
-        current_state = STATE_ID_SELECT;
-        js_audio_stop(audio[current_level_music_audio_id]);
-        js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
+        s32 row_start = tile_y * level->width;
+        s32 tile_x = 0;
+        
+        while (tile_x < level->width)
+        {
+            s32 i = row_start + tile_x;
+            
+            // Classify blocks of 4 pixels at a time. Most of a level is empty space or walls.
+            if (tile_x + 4 <= level->width)
+            {
+                u32 p0 = pixels[i + 0];
+                u32 p1 = pixels[i + 1];
+                u32 p2 = pixels[i + 2];
+                u32 p3 = pixels[i + 3];
+                
+                if (((p0 | p1 | p2 | p3) & LEVEL_PALETTE_RGB_MASK) == 0)
+                {
+                    tile_x += 4;
+                    continue;
+                }
+                
+                if (((p0 & p1 & p2 & p3) & LEVEL_PALETTE_RGB_MASK) == LEVEL_PALETTE_RGB_MASK)
+                {
+                    mem_set_u8((void *)&level->walls[i], 4, true);
+                    tile_x += 4;
+                    continue;
+                }
+            }
+            
+            enum LevelTileKind kind = level_palette_lookup(pixels[i]);
+            
+            switch (kind)
+            {
+                case LEVEL_TILE_KIND_EMPTY:
+                break;
+                
+                case LEVEL_TILE_KIND_WALL:
+                level->walls[i] = true;
+                break;
+                
+                // TODO: Add error when multiple player starts found.
+                case LEVEL_TILE_KIND_PLAYER_START:
+                level->player_pos_start_x = tile_x;
+                level->player_pos_start_y = tile_y;
+                break;
+                
+                case LEVEL_TILE_KIND_FINISH:
+                {
+                    int idx = level->finish_count;
+                    level->finish[idx].tile_x = tile_x;
+                    level->finish[idx].tile_y = tile_y;
+                    level->finish_count += 1;
+                } break;
+                
+                case LEVEL_TILE_KIND_MOVING_BLOCK_UP:
+                case LEVEL_TILE_KIND_MOVING_BLOCK_DOWN:
+                case LEVEL_TILE_KIND_MOVING_BLOCK_RANDOM:
+                {
+                    s32 y_direction_start = 0;
+                    if (kind == LEVEL_TILE_KIND_MOVING_BLOCK_UP) y_direction_start = -1;
+                    if (kind == LEVEL_TILE_KIND_MOVING_BLOCK_DOWN) y_direction_start = 1;
+                    if (kind == LEVEL_TILE_KIND_MOVING_BLOCK_RANDOM)
+                    {
+                        u32 direction = rng_get_u32_range(rng, 0, 1);
+                        if (direction == 0) y_direction_start = -1;
+                        if (direction == 1) y_direction_start = 1;
+                    }
+                    
+                    if (!level_add_moving_block(level, tile_x, tile_y, y_direction_start))
+                    {
+                        char message_storage[128];
+                        struct StrBuf message;
+                        strbuf_init(&message, message_storage, countof(message_storage));
+                        strbuf_printf(&message, "Error loading level with image id %d. Too many moving blocks!", image_id);
+                        js_show_alert(strbuf_get(&message));
+                        return false;
+                    }
+                } break;
+                
+                case LEVEL_TILE_KIND_SPIKES:
+                case LEVEL_TILE_KIND_SPIKES_OFF_BEAT:
+                {
+                    if (!level_add_spike(level, tile_x, tile_y, kind == LEVEL_TILE_KIND_SPIKES_OFF_BEAT))
+                    {
+                        char message_storage[128];
+                        struct StrBuf message;
+                        strbuf_init(&message, message_storage, countof(message_storage));
+                        strbuf_printf(&message, "Error loading level with image id %d. Too many spikes!", image_id);
+                        js_show_alert(strbuf_get(&message));
+                        return false;
+                    }
+                } break;
+                
+                default:
+                {
+                    // If we get here then we found an invalid pixel.
+                    char message_storage[128];
+                    struct StrBuf message;
+                    strbuf_init(&message, message_storage, countof(message_storage));
+                    strbuf_printf(&message, "Error loading level with image id %d. Found invalid pixel at position (%d, %d).", image_id, tile_x, tile_y);
+                    js_show_alert(strbuf_get(&message));
+                    return false;
+                }
+            }
+            
+            tile_x += 1;
+        }
     }
-}
-
-void on_frame_state_lose(void)
-{
-    video_clear_framebuffer(&framebuffer, video_make_color(0, 0, 0));
     
-    draw_level();
+    // TODO: Add error when no player starts found.
     
-    struct Color overlay_color = {0, 0, 0, 196};
-    video_draw_rect(&framebuffer, 0, 0, CANVAS_WIDTH, CANVAS_HEIGHT, overlay_color);
+    level_prepare_entities(level);
     
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "GAME OVER", CANVAS_WIDTH / 2, 4, TEXT_ALIGN_CENTER);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "RTN: Again", CANVAS_WIDTH / 2, 4 + 24, TEXT_ALIGN_CENTER);
-    video_draw_text(&framebuffer, &font[FONT_ID_SMALL], "ESC: Menu", CANVAS_WIDTH / 2, 4 + 24 + 9, TEXT_ALIGN_CENTER);
+    if (!level_build_hazards(level))
+    {
+        char message_storage[128];
+        struct StrBuf message;
+        strbuf_init(&message, message_storage, countof(message_storage));
+        strbuf_printf(&message, "Error loading level with image id %d. Too many different hazard patterns!", image_id);
+        js_show_alert(strbuf_get(&message));
+        return false;
+    }
+    
+    return true;
+}
+
+// Entities are found row by row, so each new one is inserted after the others in its column to keep
+// them sorted by column.
+bool level_add_spike(struct Level *level, s32 tile_x, s32 tile_y, bool is_up_start)
+{
+    struct LevelSpikes *spikes = &level->spikes;
+    if (spikes->count == LEVEL_MAX_SPIKE_TILES) return false;
     
-    if (keyboard_state[13] == 2)
+    s32 idx = spikes->count;
+    for (; idx > 0 && spikes->tile_x[idx - 1] > tile_x; --idx)
     {
-        current_state = STATE_ID_PLAY;
-        restart_level();
+        spikes->tile_x[idx] = spikes->tile_x[idx - 1];
+        spikes->tile_y[idx] = spikes->tile_y[idx - 1];
+        spikes->is_up_start[idx] = spikes->is_up_start[idx - 1];
     }
     
-    if (keyboard_state[27] == 2)
+    spikes->tile_x[idx] = (s16)tile_x;
+    spikes->tile_y[idx] = (s16)tile_y;
+    spikes->is_up_start[idx] = is_up_start;
+    spikes->count += 1;
+    return true;
+}
+
+bool level_add_moving_block(struct Level *level, s32 tile_x, s32 tile_y, s32 y_direction_start)
+{
+    struct LevelMovingBlocks *moving_blocks = &level->moving_blocks;
+    if (moving_blocks->count == LEVEL_MAX_MOVING_BLOCK_TILES) return false;
+    
+    s32 idx = moving_blocks->count;
+    for (; idx > 0 && moving_blocks->tile_x[idx - 1] > tile_x; --idx)
     {
-        js_audio_play(audio[AUDIO_ID_TITLE_SONG]);
-        current_state = STATE_ID_SELECT;
+        moving_blocks->tile_x[idx] = moving_blocks->tile_x[idx - 1];
+        moving_blocks->tile_y_start[idx] = moving_blocks->tile_y_start[idx - 1];
+        moving_blocks->y_direction_start[idx] = moving_blocks->y_direction_start[idx - 1];
     }
+    
+    moving_blocks->tile_x[idx] = (s16)tile_x;
+    moving_blocks->tile_y_start[idx] = (s16)tile_y;
+    moving_blocks->y_direction_start[idx] = (s8)y_direction_start;
+    moving_blocks->count += 1;
+    return true;
 }
 
-bool load_level_from_image(enum ImageId image_id)
+// Builds the column index and precomputes the moving block bounces.
+void level_prepare_entities(struct Level *level)
 {
-    bool found_player_start = false;
+    struct LevelSpikes *spikes = &level->spikes;
+    struct LevelMovingBlocks *moving_blocks = &level->moving_blocks;
     
-    current_level->width = image[image_id].width;
-    current_level->height = image[image_id].height;
+    s32 spike_idx = 0;
+    s32 moving_block_idx = 0;
+    for (s32 x = 0; x <= level->width; ++x)
+    {
+        while (spike_idx < spikes->count && spikes->tile_x[spike_idx] < x) spike_idx += 1;
+        while (moving_block_idx < moving_blocks->count && moving_blocks->tile_x[moving_block_idx] < x) moving_block_idx += 1;
+        spikes->column_start[x] = (u16)spike_idx;
+        moving_blocks->column_start[x] = (u16)moving_block_idx;
+    }
     
-    if (current_level->width > LEVEL_MAX_WIDTH ||
-        current_level->height > LEVEL_MAX_HEIGHT)
+    for (s32 i = 0; i < moving_blocks->count; ++i)
     {
-        strbuf_clear();
-        strbuf_push_string("Error loading level with image id ");
-        strbuf_push_s32(image_id);
-        strbuf_push_string(". Level dimensions are too big!");
-        js_show_alert(strbuf_get());
-        return false;
+        s32 x = moving_blocks->tile_x[i];
+        s32 y = moving_blocks->tile_y_start[i];
+        
+        // Rows outside the level count as walls.
+        s32 top_y = y;
+        s32 bottom_y = y;
+        while (top_y > 0 && !level->walls[(top_y - 1) * level->width + x]) top_y -= 1;
+        while (bottom_y < level->height - 1 && !level->walls[(bottom_y + 1) * level->width + x]) bottom_y += 1;
+        
+        // Going down the path is offsets 0 to length - 1, and coming back up is the rest of the period.
+        // A block with walls on both sides never moves.
+        s32 length = bottom_y - top_y + 1;
+        s32 period = 2 * (length - 1);
+        s32 offset = y - top_y;
+        s32 phase_start = 0;
+        if (period > 0 && moving_blocks->y_direction_start[i] > 0) phase_start = offset;
+        if (period > 0 && moving_blocks->y_direction_start[i] < 0) phase_start = (period - offset) % period;
+        
+        moving_blocks->bounce_top_y[i] = (s16)top_y;
+        moving_blocks->bounce_length[i] = (s16)length;
+        moving_blocks->bounce_period[i] = (s16)period;
+        moving_blocks->bounce_phase_start[i] = (s16)phase_start;
     }
+}
+
+// Entities step once per beat.
+bool level_spike_is_up(struct LevelSpikes *spikes, s32 idx, s32 tick)
+{
+    return spikes->is_up_start[idx] != (((tick / 4) & 1) != 0);
+}
+
+s32 level_moving_block_get_tile_y(struct LevelMovingBlocks *moving_blocks, s32 idx, s32 tick)
+{
+    s32 period = moving_blocks->bounce_period[idx];
+    if (period == 0) return moving_blocks->tile_y_start[idx];
     
-    struct Color *pixels = (struct Color*)image[image_id].data;
+    s32 phase = (moving_blocks->bounce_phase_start[idx] + (tick / 4)) % period;
+    s32 offset = (phase < moving_blocks->bounce_length[idx]) ? phase : period - phase;
+    return moving_blocks->bounce_top_y[idx] + offset;
+}
+
+// Works out the schedule of every tile, one column at a time. Blocks in the same run of rows between
+// walls share a period, and spikes flip every beat, so the period of a tile is the period of the
+// blocks passing through it or 2 beats if only a spike is there.
+bool level_build_hazards(struct Level *level)
+{
+    struct LevelHazards *hazards = &level->hazards;
+    struct LevelSpikes *spikes = &level->spikes;
+    struct LevelMovingBlocks *moving_blocks = &level->moving_blocks;
     
-    current_level->finish_count = 0;
-    current_level->spikes_count = 0;
-    current_level->moving_blocks_count = 0;
+    mem_set_u8((void *)hazards->hash_slots, sizeof(hazards->hash_slots), 0);
+    hazards->schedule_count = 0;
     
-    for (int i = 0; i < LEVEL_TILE_COUNT; ++i) current_level->walls[i] = false;
+    u8 bits[LEVEL_HAZARD_SCHEDULE_BYTES] = {0};
+    level_add_hazard_schedule(hazards, 1, bits);
+    bits[0] = 1;
+    level_add_hazard_schedule(hazards, 1, bits);
     
-    for (int i = 0; i < current_level->width * current_level->height; ++i)
+    u8 column_periods[LEVEL_MAX_HEIGHT];
+    u8 column_bits[LEVEL_MAX_HEIGHT][LEVEL_HAZARD_SCHEDULE_BYTES];
+    for (s32 x = 0; x < level->width; ++x)
     {
-        s32 tile_x = i % current_level->width;
-        s32 tile_y = i / current_level->width;
+        mem_set_u8(column_periods, level->height, 0);
+        mem_set_u8((void *)column_bits, sizeof(column_bits), 0);
         
-        // Empty space.
-        if (pixels[i].r == 0 &&
-            pixels[i].g == 0 &&
-            pixels[i].b == 0)
+        // A block that can't move gets a period of 1 beat.
+        for (s32 i = moving_blocks->column_start[x]; i < moving_blocks->column_start[x + 1]; ++i)
         {
-            continue;
+            s32 period = math_max_s32(moving_blocks->bounce_period[i], 1);
+            s32 top_y = moving_blocks->bounce_top_y[i];
+            for (s32 y = top_y; y < top_y + moving_blocks->bounce_length[i]; ++y) column_periods[y] = (u8)period;
         }
-        
-        // Wall.
-        if (pixels[i].r == 255 &&
-            pixels[i].g == 255 &&
-            pixels[i].b == 255)
+        for (s32 i = spikes->column_start[x]; i < spikes->column_start[x + 1]; ++i)
         {
-            current_level->walls[i] = true;
-            continue;
+            if (column_periods[spikes->tile_y[i]] == 0) column_periods[spikes->tile_y[i]] = 2;
         }
         
-        // Player start.
-        // TODO: Add error when multiple player starts found.
-        if (pixels[i].r == 34 &&
-            pixels[i].g == 177 &&
-            pixels[i].b == 76)
+        for (s32 i = moving_blocks->column_start[x]; i < moving_blocks->column_start[x + 1]; ++i)
         {
-            current_level->player_pos_start_x = tile_x;
-            current_level->player_pos_start_y = tile_y;
-            continue;
+            s32 period = math_max_s32(moving_blocks->bounce_period[i], 1);
+            for (s32 beat = 0; beat < period; ++beat)
+            {
+                s32 y = level_moving_block_get_tile_y(moving_blocks, i, beat * 4);
+                column_bits[y][beat / 8] |= (u8)(1 << (beat % 8));
+            }
         }
-        
-        // Finish.
-        if (pixels[i].r == 36 &&
-            pixels[i].g == 123 &&
-            pixels[i].b == 21)
+        for (s32 i = spikes->column_start[x]; i < spikes->column_start[x + 1]; ++i)
         {
-            int idx = current_level->finish_count;
-            current_level->finish[idx].tile_x = tile_x;
-            current_level->finish[idx].tile_y = tile_y;
-            current_level->finish_count += 1;
-            continue;
+            s32 y = spikes->tile_y[i];
+            for (s32 beat = 0; beat < column_periods[y]; ++beat)
+            {
+                if (level_spike_is_up(spikes, i, beat * 4)) column_bits[y][beat / 8] |= (u8)(1 << (beat % 8));
+            }
         }
         
-        // Moving block. (Up direction)
-        if (pixels[i].r == 255 &&
-            pixels[i].g == 218 &&
-            pixels[i].b == 91)
+        for (s32 y = 0; y < level->height; ++y)
         {
-            int idx = current_level->moving_blocks_count;
-            current_level->moving_blocks[idx].y_direction_start = -1;
-            current_level->moving_blocks[idx].y_direction = current_level->moving_blocks[idx].y_direction_start;
-            current_level->moving_blocks[idx].entity.tile_x = tile_x;
-            current_level->moving_blocks[idx].entity.tile_y = tile_y;
-            current_level->moving_blocks[idx].tile_x_start = tile_x;
-            current_level->moving_blocks[idx].tile_y_start = tile_y;
-            current_level->moving_blocks_count += 1;
-            continue;
+            s32 tile_idx = y * level->width + x;
+            s32 schedule_idx = LEVEL_HAZARD_SCHEDULE_NEVER;
+            s32 shift = 0;
+            if (level->walls[tile_idx]) schedule_idx = LEVEL_HAZARD_SCHEDULE_ALWAYS;
+            else if (column_periods[y] > 0)
+            {
+                s32 period = column_periods[y];
+                s32 first_beat = 0;
+                while (first_beat < period && !((column_bits[y][first_beat / 8] >> (first_beat % 8)) & 1)) first_beat += 1;
+                if (first_beat == period) first_beat = 0;
+                
+                mem_set_u8(bits, LEVEL_HAZARD_SCHEDULE_BYTES, 0);
+                for (s32 beat = 0; beat < period; ++beat)
+                {
+                    s32 src_beat = (beat + first_beat) % period;
+                    if ((column_bits[y][src_beat / 8] >> (src_beat % 8)) & 1) bits[beat / 8] |= (u8)(1 << (beat % 8));
+                }
+                
+                schedule_idx = level_add_hazard_schedule(hazards, (u8)period, bits);
+                shift = (period - first_beat) % period;
+            }
+            
+            if (schedule_idx < 0) return false;
+            hazards->tile_schedule[tile_idx] = (u16)schedule_idx;
+            hazards->tile_schedule_shift[tile_idx] = (u8)shift;
         }
+    }
+    
+    return true;
+}
+
+// Returns the index of the matching schedule, adding it if there isn't one, or -1 if there's no space left.
+s32 level_add_hazard_schedule(struct LevelHazards *hazards, u8 period, u8 *bits)
+{
+    u32 hash = 2166136261u ^ period;
+    for (s32 i = 0; i < LEVEL_HAZARD_SCHEDULE_BYTES; ++i)
+    {
+        hash = (hash * 16777619u) ^ bits[i];
+    }
+    
+    u32 slot = hash & (LEVEL_HAZARD_HASH_SLOTS - 1);
+    while (hazards->hash_slots[slot] != 0)
+    {
+        s32 idx = hazards->hash_slots[slot] - 1;
         
-        // Moving block. (Down direction)
-        if (pixels[i].r == 138 &&
-            pixels[i].g == 107 &&
-            pixels[i].b == 0)
+        bool is_match = (hazards->schedule_period[idx] == period);
+        for (s32 i = 0; i < LEVEL_HAZARD_SCHEDULE_BYTES && is_match; ++i)
         {
-            int idx = current_level->moving_blocks_count;
-            current_level->moving_blocks[idx].y_direction_start = 1;
-            current_level->moving_blocks[idx].y_direction = current_level->moving_blocks[idx].y_direction_start;
-            current_level->moving_blocks[idx].entity.tile_x = tile_x;
-            current_level->moving_blocks[idx].entity.tile_y = tile_y;
-            current_level->moving_blocks[idx].tile_x_start = tile_x;
-            current_level->moving_blocks[idx].tile_y_start = tile_y;
-            current_level->moving_blocks_count += 1;
-            continue;
+            is_match = (hazards->schedule_bits[idx][i] == bits[i]);
         }
+        if (is_match) return idx;
         
-        // Moving block. (Random direction)
-        if (pixels[i].r == 255 &&
-            pixels[i].g == 201 &&
-            pixels[i].b == 14)
+        slot = (slot + 1) & (LEVEL_HAZARD_HASH_SLOTS - 1);
+    }
+    
+    if (hazards->schedule_count == LEVEL_MAX_HAZARD_SCHEDULES) return -1;
+    
+    s32 idx = hazards->schedule_count;
+    hazards->schedule_period[idx] = period;
+    mem_copy(hazards->schedule_bits[idx], bits, LEVEL_HAZARD_SCHEDULE_BYTES);
+    hazards->hash_slots[slot] = (u16)(idx + 1);
+    hazards->schedule_count += 1;
+    return idx;
+}
+
+// Whether a wall, a raised spike or a moving block is on the tile at the given tick. Tiles outside the
+// level are deadly.
+bool level_is_tile_deadly(struct Level *level, s32 tile_x, s32 tile_y, s32 tick)
+{
+    if (tile_x < 0 || tile_x >= level->width || tile_y < 0 || tile_y >= level->height) return true;
+    
+    s32 tile_idx = tile_y * level->width + tile_x;
+    s32 schedule_idx = level->hazards.tile_schedule[tile_idx];
+    s32 beat = ((tick / 4) + level->hazards.tile_schedule_shift[tile_idx]) % level->hazards.schedule_period[schedule_idx];
+    return (level->hazards.schedule_bits[schedule_idx][beat / 8] >> (beat % 8)) & 1;
+}
+
+// The walls and entities in view are put in a tile layer that's drawn a row of the screen at a time,
+// and the player is drawn over it.
+void draw_level(struct GameContext *game)
+{
+    // Draw level at camera position.
+    s32 offset_x = -math_round_f32_to_s32(game->camera_pos_x);
+    s32 offset_y = -math_round_f32_to_s32(game->camera_pos_y);
+    struct Level *level = game->play.level;
+    
+    // Only the visible columns are looked at.
+    s32 first_visible_column = (-offset_x - 7) / 8;
+    s32 last_visible_column = (-offset_x + game->framebuffer.width) / 8;
+    if (first_visible_column < 0) first_visible_column = 0;
+    if (last_visible_column > level->width - 1) last_visible_column = level->width - 1;
+    if (last_visible_column < first_visible_column) last_visible_column = first_visible_column - 1;
+    s32 visible_column_end = last_visible_column + 1;
+    s32 visible_column_count = visible_column_end - first_visible_column;
+    ASSERT(visible_column_count <= game->framebuffer.width / 8 + 2);
+    
+    struct Image *tile_images[LEVEL_LAYER_TILE_COUNT] = {
+        [LEVEL_LAYER_TILE_WALL] = &image[game->level_wall_image_id],
+        [LEVEL_LAYER_TILE_FINISH] = &image[IMAGE_ID_FINISH],
+        [LEVEL_LAYER_TILE_SPIKES_DOWN] = &image[IMAGE_ID_SPIKES_DOWN],
+        [LEVEL_LAYER_TILE_SPIKES_UP] = &image[IMAGE_ID_SPIKES_UP],
+        [LEVEL_LAYER_TILE_MOVING_BLOCK] = &image[IMAGE_ID_MOVING_BLOCK],
+    };
+    struct VideoTileLayer layer = {
+        .tiles = game->level_layer_tiles,
+        .width = visible_column_count,
+        .height = level->height,
+        .tile_size = 8,
+        .tile_images = tile_images,
+    };
+    
+    // Fill in walls.
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_WALLS);
+    for (s32 tile_y = 0; tile_y < level->height; ++tile_y)
+    {
+        bool *walls = &level->walls[tile_y * level->width + first_visible_column];
+        u8 *tiles = &layer.tiles[tile_y * layer.width];
+        for (s32 i = 0; i < visible_column_count; ++i)
         {
-            int idx = current_level->moving_blocks_count;
-            
-            u32 direction = rng_get_u32_range(0, 1);
-            if (direction == 0) current_level->moving_blocks[idx].y_direction_start = -1;
-            if (direction == 1) current_level->moving_blocks[idx].y_direction_start = 1;
-            
-            current_level->moving_blocks[idx].y_direction = current_level->moving_blocks[idx].y_direction_start;
-            current_level->moving_blocks[idx].entity.tile_x = tile_x;
-            current_level->moving_blocks[idx].entity.tile_y = tile_y;
-            current_level->moving_blocks[idx].tile_x_start = tile_x;
-            current_level->moving_blocks[idx].tile_y_start = tile_y;
-            current_level->moving_blocks_count += 1;
-            continue;
+            tiles[i] = walls[i] ? LEVEL_LAYER_TILE_WALL : LEVEL_LAYER_TILE_NONE;
         }
+    }
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_WALLS);
+    
+    // Fill in entities, in the order they used to be drawn in.
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_ENTITIES);
+    for (int i = 0; i < level->finish_count; ++i)
+    {
+        s32 column = level->finish[i].tile_x - first_visible_column;
+        if (column < 0 || column >= visible_column_count) continue;
+        layer.tiles[level->finish[i].tile_y * layer.width + column] = LEVEL_LAYER_TILE_FINISH;
+    }
+    
+    s32 tick = game->play.tick_count;
+    struct LevelSpikes *spikes = &level->spikes;
+    for (int i = spikes->column_start[first_visible_column]; i < spikes->column_start[visible_column_end]; ++i)
+    {
+        u8 tile = level_spike_is_up(spikes, i, tick) ? LEVEL_LAYER_TILE_SPIKES_UP : LEVEL_LAYER_TILE_SPIKES_DOWN;
+        layer.tiles[spikes->tile_y[i] * layer.width + (spikes->tile_x[i] - first_visible_column)] = tile;
+    }
+    
+    struct LevelMovingBlocks *moving_blocks = &level->moving_blocks;
+    for (int i = moving_blocks->column_start[first_visible_column]; i < moving_blocks->column_start[visible_column_end]; ++i)
+    {
+        s32 tile_y = level_moving_block_get_tile_y(moving_blocks, i, tick);
+        layer.tiles[tile_y * layer.width + (moving_blocks->tile_x[i] - first_visible_column)] = LEVEL_LAYER_TILE_MOVING_BLOCK;
+    }
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_ENTITIES);
+    
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_WALLS);
+    video_draw_tile_layer(&game->framebuffer, &layer, offset_x + first_visible_column * 8, offset_y);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_WALLS);
+    
+    // Draw player.
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_ENTITIES);
+    {
+        s32 pos_x = (game->play.player_tile_pos_x * 8) + offset_x;
+        s32 pos_y = (game->play.player_tile_pos_y * 8) + offset_y;
+        draw_8x8_tile(&game->framebuffer, IMAGE_ID_PLAYER, pos_x, pos_y);
+    }
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_ENTITIES);
+}
+
+// Converts a host timestamp to the time since the level started, rounded to whole microseconds so
+// that replays store exactly the values the simulation saw.
+f64 play_time_from_host_time(struct GameContext *game, f64 host_time_ms)
+{
+    f64 time_ms = host_time_ms - game->level_start_time_ms;
+    if (time_ms < 0.0) time_ms = 0.0;
+    
+    u32 time_us = (u32)(time_ms * 1000.0 + 0.5);
+    return (f64)time_us / 1000.0;
+}
+
+// Runs any ticks due before the event, then applies it.
+enum PlayResult play_simulate_event(struct PlayContext *play, struct InputEvent event)
+{
+    enum PlayResult result = play_run_ticks_until(play, event.time_ms);
+    if (result != PLAY_RESULT_NONE || !event.is_down) return result;
+    
+    if (SPACE_TO_MOVE && event.key == JS_KEY_CODE_SPACE)
+    {
+        play->player_tile_pos_x += 1;
+        play->player_tick_capacitor = 0;
+    }
+    if (event.key == JS_KEY_CODE_UP) play->player_tile_pos_y -= 1;
+    if (event.key == JS_KEY_CODE_DOWN) play->player_tile_pos_y += 1;
+    
+    return play_check_collisions(play);
+}
+
+enum PlayResult play_run_ticks_until(struct PlayContext *play, f64 time_ms)
+{
+    while (true)
+    {
+        if (time_ms < play_get_tick_time_ms(play, play->tick_count + 1)) return PLAY_RESULT_NONE;
         
-        // Spikes.
-        if (pixels[i].r == 127 &&
-            pixels[i].g == 127 &&
-            pixels[i].b == 127)
-        {
-            int idx = current_level->spikes_count;
-            current_level->spikes[idx].is_up_start = false;
-            current_level->spikes[idx].entity.tile_x = tile_x;
-            current_level->spikes[idx].entity.tile_y = tile_y;
-            current_level->spikes_count += 1;
-            continue;
-        }
+        play_tick(play);
+        
+        enum PlayResult result = play_check_collisions(play);
+        if (result != PLAY_RESULT_NONE) return result;
+    }
+}
+
+// Tick times are computed from the tick number rather than added up, so they don't drift over a long level.
+f64 play_get_tick_time_ms(struct PlayContext *play, s32 tick)
+{
+    return (f64)tick * (play->beat_len_ms / 4.0);
+}
+
+// Spikes and moving blocks are computed from the tick count, so only the player needs updating.
+void play_tick(struct PlayContext *play)
+{
+    play->tick_count += 1;
+    play->player_tick_capacitor += 1;
+    
+    // Handle player movement.
+    if (!SPACE_TO_MOVE && play->player_tick_capacitor >= 4)
+    {
+#if PLAY_COWBELL
+        js_audio_play(audio[AUDIO_ID_COWBELL]);
+#endif
+        play->player_tile_pos_x += 1;
+        play->player_tick_capacitor = 0;
+    }
+}
+
+enum PlayResult play_check_collisions(struct PlayContext *play)
+{
+    struct LevelEntity *finish = get_level_finish_at_pos(play->level, play->player_tile_pos_x, play->player_tile_pos_y);
+    
+    if (level_is_tile_deadly(play->level, play->player_tile_pos_x, play->player_tile_pos_y, play->tick_count))
+    {
+        if (!GOD_MODE) return PLAY_RESULT_LOSE;
+    }
+    if (finish != NULL) return PLAY_RESULT_WIN;
+    
+    return PLAY_RESULT_NONE;
+}
+
+bool load_level(struct PlayContext *play, s32 level_idx, u32 rng_seed)
+{
+    ASSERT(level_idx >= 0 && level_idx < LEVEL_COUNT);
+    
+    play->level_idx = level_idx;
+    play->beat_len_ms = level_beat_len_ms[level_idx];
+    play->level_rng_seed = rng_seed;
+    rng_set_seed(&play->rng, rng_seed);
+    
+    return load_level_from_image(play->level, &play->rng, level_image[level_idx]);
+}
+
+// Loads a level into the game's play context, with a fresh seed from the game's RNG.
+bool game_load_level(struct GameContext *game, s32 level_idx)
+{
+    game->level_wall_image_id = level_wall_image[level_idx];
+    game->level_music_audio_id = level_music_audio[level_idx];
+    
+    f64 load_start_time_ms = js_get_time_ms();
+    bool success = load_level(&game->play, level_idx, rng_get_u32(&game->rng));
+    game->level_load_time_ms[level_idx] = js_get_time_ms() - load_start_time_ms;
+    
+    return success;
+}
+
+// Resets the simulation to the start of the level. Doesn't touch audio or the camera.
+void reset_level(struct PlayContext *play)
+{
+    play->player_tick_capacitor = 0;
+    
+    play->player_tile_pos_x = play->level->player_pos_start_x;
+    play->player_tile_pos_y = play->level->player_pos_start_y;
+    
+    play->tick_count = 0;
+}
+
+void restart_level(struct GameContext *game)
+{
+    reset_level(&game->play);
+    
+    game->camera_pos_x = (f32)((game->play.player_tile_pos_x * 8) - (game->framebuffer.width / 2 - 4));
+    game->camera_pos_y = (f32)((game->play.player_tile_pos_y * 8) - (game->framebuffer.height / 2 - 4));
+    
+    js_audio_play(audio[game->level_music_audio_id]);
+    game->level_start_time_ms = js_get_time_ms();
+    //game->level_start_time_ms = js_audio_get_time(audio[AUDIO_ID_LEVEL_1_SONG]);
+    game->level_simulated_time_ms = 0.0;
+    
+    game->has_practice_checkpoint = false;
+    game->practice_checkpoint.play_tick_count = 0;
+    
+    replay_begin_recording(&game->replay_recording);
+}
+
+// Resumes from the last practice checkpoint, with the music at the matching position.
+void restart_level_from_checkpoint(struct GameContext *game)
+{
+    ASSERT(game->has_practice_checkpoint);
+    
+    play_restore_snapshot(game, &game->practice_checkpoint);
+    
+    f64 tick_time_ms = play_get_tick_time_ms(&game->play, game->play.tick_count);
+    game->level_start_time_ms = js_get_time_ms() - tick_time_ms;
+    game->level_simulated_time_ms = tick_time_ms;
+    js_audio_set_time(audio[game->level_music_audio_id], tick_time_ms);
+    js_audio_play(audio[game->level_music_audio_id]);
+    
+    // The session no longer starts at the beginning of the level, so it can't be replayed.
+    replay_discard_recording(&game->replay_recording);
+}
+
+void play_on_result(struct GameContext *game, enum PlayResult result)
+{
+    replay_end_recording(&game->replay_recording, &game->play, result);
+    telemetry_save(&game->telemetry);
+    
+    if (result == PLAY_RESULT_LOSE)
+    {
+        game->current_state = STATE_ID_LOSE;
+        js_audio_stop(audio[game->level_music_audio_id]);
+        js_audio_play(audio[AUDIO_ID_FAIL]);
+    }
+    if (result == PLAY_RESULT_WIN)
+    {
+        game->current_state = STATE_ID_WIN;
         
-        // Off-beat spikes.
-        if (pixels[i].r == 195 &&
-            pixels[i].g == 195 &&
-            pixels[i].b == 195)
+        // Practice wins can resume from a checkpoint part way through, so they don't unlock levels.
+        if (!game->is_practice_mode)
         {
-            int idx = current_level->spikes_count;
-            current_level->spikes[idx].is_up_start = true;
-            current_level->spikes[idx].entity.tile_x = tile_x;
-            current_level->spikes[idx].entity.tile_y = tile_y;
-            current_level->spikes_count += 1;
-            continue;
+            game->level_idx_unlocked += 1;
+            js_localstore_set_s32("squares_progress", game->level_idx_unlocked);
         }
-        
-        // If we get here then we found an invalid pixel.
-        strbuf_clear();
-        strbuf_push_string("Error loading level with image id ");
-        strbuf_push_s32(image_id);
-        strbuf_push_string(". Found invalid pixel at position (");
-        strbuf_push_s32(i % current_level->width);
-        strbuf_push_string(", ");
-        strbuf_push_s32(i / current_level->width);
-        strbuf_push_string(").");
-        js_show_alert(strbuf_get());
-        return false;
     }
+}
+
+void play_capture_snapshot(struct GameContext *game, struct PlaySnapshot *snapshot)
+{
+    snapshot->player_tile_pos_x = game->play.player_tile_pos_x;
+    snapshot->player_tile_pos_y = game->play.player_tile_pos_y;
+    snapshot->player_tick_capacitor = game->play.player_tick_capacitor;
+    snapshot->play_tick_count = game->play.tick_count;
+    snapshot->camera_pos_x = game->camera_pos_x;
+    snapshot->camera_pos_y = game->camera_pos_y;
+    snapshot->rng_seed = rng_get_seed(&game->play.rng);
+}
+
+void play_restore_snapshot(struct GameContext *game, struct PlaySnapshot *snapshot)
+{
+    game->play.player_tile_pos_x = snapshot->player_tile_pos_x;
+    game->play.player_tile_pos_y = snapshot->player_tile_pos_y;
+    game->play.player_tick_capacitor = snapshot->player_tick_capacitor;
+    game->play.tick_count = snapshot->play_tick_count;
+    game->camera_pos_x = snapshot->camera_pos_x;
+    game->camera_pos_y = snapshot->camera_pos_y;
+    rng_set_seed(&game->play.rng, snapshot->rng_seed);
+}
+
+// Only replays and the solver use the headless level, so it isn't allocated until one of them first runs.
+void headless_play_alloc_level(struct GameContext *game)
+{
+    if (game->headless_play.level != NULL) return;
     
-    // TODO: Add error when no player starts found.
+    game->headless_play.level = mem_alloc(sizeof(*game->headless_play.level));
+    mem_set_u8((void*)game->headless_play.level, sizeof(*game->headless_play.level), 0);
+}
+
+void replay_begin_recording(struct Replay *replay)
+{
+    replay->is_recording = true;
+    replay->has_overflowed = false;
+    replay->event_count = 0;
+    replay->size = REPLAY_HEADER_SIZE;
+}
+
+void replay_discard_recording(struct Replay *replay)
+{
+    replay->is_recording = false;
+    replay->size = 0;
+}
+
+void replay_record_event(struct Replay *replay, struct InputEvent event)
+{
+    if (!replay->is_recording) return;
+    
+    if (replay->event_count == REPLAY_MAX_EVENTS)
+    {
+        replay->has_overflowed = true;
+        return;
+    }
+    
+    u8 *dest = &replay->data[replay->size];
+    mem_write_u32_le(dest, (u32)(event.time_ms * 1000.0 + 0.5));
+    dest[4] = event.key;
+    dest[5] = event.is_down;
+    
+    replay->size += REPLAY_EVENT_SIZE;
+    replay->event_count += 1;
+}
+
+void replay_end_recording(struct Replay *replay, struct PlayContext *play, enum PlayResult result)
+{
+    if (!replay->is_recording) return;
+    replay->is_recording = false;
+    
+    // A log with missing events can't be replayed.
+    if (replay->has_overflowed)
+    {
+        replay->size = 0;
+        return;
+    }
+    
+    u8 *header = replay->data;
+    mem_write_u32_le(&header[0], REPLAY_MAGIC);
+    header[4] = REPLAY_VERSION;
+    header[5] = (u8)play->level_idx;
+    header[6] = (u8)result;
+    header[7] = 0;
+    mem_write_u32_le(&header[8], play->level_rng_seed);
+    mem_write_u32_le(&header[12], (u32)play->tick_count);
+    mem_write_u32_le(&header[16], (u32)replay->event_count);
+}
+
+// Runs a replay log through the simulation without audio or rendering.
+bool replay_run(struct PlayContext *play, u8 *data, s32 size, enum PlayResult *result, s32 *end_tick)
+{
+    ASSERT(data != NULL);
+    ASSERT(result != NULL);
+    ASSERT(end_tick != NULL);
+    
+    if (size < REPLAY_HEADER_SIZE) return false;
+    if (mem_read_u32_le(&data[0]) != REPLAY_MAGIC || data[4] != REPLAY_VERSION) return false;
+    
+    s32 level_idx = data[5];
+    u32 seed = mem_read_u32_le(&data[8]);
+    u32 event_count = mem_read_u32_le(&data[16]);
+    if (level_idx >= LEVEL_COUNT) return false;
+    if (event_count > REPLAY_MAX_EVENTS || REPLAY_HEADER_SIZE + (s32)event_count * REPLAY_EVENT_SIZE > size) return false;
+    
+    // Load the level exactly as it was when recorded.
+    if (!load_level(play, level_idx, seed)) return false;
+    
+    reset_level(play);
     
+    *result = play_check_collisions(play);
+    for (u32 i = 0; i < event_count && *result == PLAY_RESULT_NONE; ++i)
+    {
+        u8 *src = &data[REPLAY_HEADER_SIZE + i * REPLAY_EVENT_SIZE];
+        struct InputEvent event = {
+            .time_ms = (f64)mem_read_u32_le(src) / 1000.0,
+            .key = src[4],
+            .is_down = src[5] != 0,
+        };
+        *result = play_simulate_event(play, event);
+    }
+    
+    // Keep running until the player wins or dies, giving up once they would have passed the end of the level.
+    // Sessions that were quit stop at the tick the player quit on.
+    s32 tick_limit = (play->level->width + 1) * 4;
+    if (data[6] == PLAY_RESULT_NONE) tick_limit = (s32)mem_read_u32_le(&data[12]);
+    while (*result == PLAY_RESULT_NONE && play->tick_count < tick_limit)
+    {
+        *result = play_run_ticks_until(play, play_get_tick_time_ms(play, play->tick_count + 1));
+    }
+    
+    *end_tick = play->tick_count;
     return true;
 }
 
-void draw_level(void)
+// Searches every way through the level. Moving up and down is free between ticks, so the player can
+// reach any row of the run of safe rows they are in, and the only state that matters at each tick is
+// the set of rows they can be in. Entities don't depend on the player, so that set is a bitmask that
+// is stepped forward alongside a single simulation.
+// Assumes the player moves forward on their own (SPACE_TO_MOVE off).
+bool solve_level(struct Solver *solver, struct PlayContext *play, struct LevelSolution *solution)
 {
-    // Draw level at camera position.
-    s32 offset_x = -math_round_f32_to_s32(camera_pos_x);
-    s32 offset_y = -math_round_f32_to_s32(camera_pos_y);
+    struct Level *level = play->level;
     
-    // Draw walls.
-    for (int i = 0; i < LEVEL_TILE_COUNT; ++i)
+    *solution = (struct LevelSolution) {0};
+    solution->first_win_tick = -1;
+    solution->reaction_window_ticks = -1;
+    
+    reset_level(play);
+    
+    mem_set_u8((void *)solver->path_counts, sizeof(solver->path_counts), 0);
+    solver->path_counts[play->player_tile_pos_y] = 1;
+    u64 arrived_rows = (u64)1 << play->player_tile_pos_y;
+    
+    // Forward pass. Find the rows the player can reach and count the paths into them.
+    s32 tick_count = 0;
+    s32 tick_limit = (level->width + 1) * 4;
+    for (s32 tick = 0; tick < tick_limit && arrived_rows != 0; ++tick)
     {
-        s32 tile_x = i % current_level->width;
-        s32 tile_y = i / current_level->width;
-        s32 pos_x = (tile_x * 8) + offset_x;
-        s32 pos_y = (tile_y * 8) + offset_y;
+        if (tick > 0) play_tick(play);
+        
+        u64 safe_rows = solver_get_safe_rows(level, play->player_tile_pos_x, play->tick_count);
+        u64 finish_rows = solver_get_finish_rows(level, play->player_tile_pos_x);
+        u64 reachable_rows = 0;
+        u64 continuing_rows = 0;
+        arrived_rows &= safe_rows;
         
-        if (pos_x < -8 || pos_y < -8 ||
-            pos_x >= CANVAS_WIDTH || pos_y >= CANVAS_HEIGHT)
+        s32 y = 0;
+        while (y < level->height)
         {
-            // Skip this tile if it is completely outside the screen.
-            continue;
+            if (!((safe_rows >> y) & 1))
+            {
+                solver->path_counts[y] = 0;
+                y += 1;
+                continue;
+            }
+            
+            // Sum the paths into this run of safe rows.
+            s32 run_start = y;
+            u64 run_path_count = 0;
+            for (; y < level->height && ((safe_rows >> y) & 1); ++y)
+            {
+                if (!((arrived_rows >> y) & 1)) continue;
+                run_path_count += solver->path_counts[y];
+                if (run_path_count < solver->path_counts[y]) run_path_count = ~(u64)0;
+            }
+            
+            u64 run_rows = (~(u64)0 >> (64 - (y - run_start))) << run_start;
+            bool is_reached = (run_rows & arrived_rows) != 0;
+            bool is_winning = is_reached && (run_rows & finish_rows) != 0;
+            
+            if (is_reached) reachable_rows |= run_rows;
+            if (is_reached && !is_winning) continuing_rows |= run_rows;
+            
+            if (is_winning)
+            {
+                solution->winning_path_count += run_path_count;
+                if (solution->winning_path_count < run_path_count) solution->winning_path_count = ~(u64)0;
+                if (solution->first_win_tick < 0) solution->first_win_tick = tick;
+            }
+            
+            // Every row of the run can be reached by every path into it. Paths that won are done.
+            for (s32 i = run_start; i < y; ++i) solver->path_counts[i] = (is_reached && !is_winning) ? run_path_count : 0;
         }
         
-        if (current_level->walls[i]) draw_8x8_tile(current_level_wall_image_id, pos_x, pos_y);
+        solver->safe_rows[tick] = safe_rows;
+        solver->finish_rows[tick] = finish_rows;
+        solver->reachable_rows[tick] = reachable_rows;
+        arrived_rows = continuing_rows;
+        tick_count = tick + 1;
     }
     
-    // Draw finishes.
-    for (int i = 0; i < current_level->finish_count; ++i)
+    solution->is_solvable = solution->first_win_tick >= 0;
+    if (!solution->is_solvable) return false;
+    
+    // Backward pass. Keep the rows from which the level can still be won, and measure how many ticks
+    // the player can stay in each of them. The tightest reaction window is the smallest, over all ticks,
+    // of the longest time the player can wait without moving.
+    const s32 run_ticks_unlimited = 0x7FFFFFFF;
+    s32 *run_ticks = solver->run_ticks[0];
+    s32 *next_run_ticks = solver->run_ticks[1];
+    mem_set_s32(next_run_ticks, LEVEL_MAX_HEIGHT, 0);
+    u64 next_good_rows = 0;
+    s32 reaction_window_ticks = run_ticks_unlimited;
+    
+    for (s32 tick = tick_count - 1; tick >= 0; --tick)
     {
-        s32 pos_x = offset_x + (current_level->finish[i].tile_x * 8);
-        s32 pos_y = offset_y + (current_level->finish[i].tile_y * 8);
+        u64 reachable_rows = solver->reachable_rows[tick];
+        u64 finish_rows = solver->finish_rows[tick];
+        u64 good_rows = 0;
+        s32 window_ticks = 0;
         
-        if (pos_x < -8 || pos_y < -8 ||
-            pos_x >= CANVAS_WIDTH || pos_y >= CANVAS_HEIGHT)
+        s32 y = 0;
+        while (y < level->height)
         {
-            // Skip this tile if it is completely outside the screen.
-            continue;
+            if (!((reachable_rows >> y) & 1))
+            {
+                run_ticks[y] = 0;
+                y += 1;
+                continue;
+            }
+            
+            s32 run_start = y;
+            while (y < level->height && ((reachable_rows >> y) & 1)) y += 1;
+            u64 run_rows = (~(u64)0 >> (64 - (y - run_start))) << run_start;
+            
+            bool is_winning = (run_rows & finish_rows) != 0;
+            bool is_good = is_winning || (run_rows & next_good_rows) != 0;
+            if (is_good) good_rows |= run_rows;
+            
+            for (s32 i = run_start; i < y; ++i)
+            {
+                if (!is_good) run_ticks[i] = 0;
+                else if (is_winning || next_run_ticks[i] == run_ticks_unlimited) run_ticks[i] = run_ticks_unlimited;
+                else run_ticks[i] = next_run_ticks[i] + 1;
+                
+                if (run_ticks[i] > window_ticks) window_ticks = run_ticks[i];
+            }
         }
         
-        draw_8x8_tile(IMAGE_ID_FINISH, pos_x, pos_y);
+        if (good_rows != 0 && window_ticks < reaction_window_ticks) reaction_window_ticks = window_ticks;
+        
+        next_good_rows = good_rows;
+        s32 *swap = run_ticks;
+        run_ticks = next_run_ticks;
+        next_run_ticks = swap;
     }
     
-    // Draw spikes.
-    for (int i = 0; i < current_level->spikes_count; ++i)
+    if (reaction_window_ticks != run_ticks_unlimited)
     {
-        s32 pos_x = offset_x + (current_level->spikes[i].entity.tile_x * 8);
-        s32 pos_y = offset_y + (current_level->spikes[i].entity.tile_y * 8);
-        
-        if (pos_x < -8 || pos_y < -8 ||
-            pos_x >= CANVAS_WIDTH || pos_y >= CANVAS_HEIGHT)
+        solution->reaction_window_ticks = reaction_window_ticks;
+        solution->reaction_window_ms = (f32)(reaction_window_ticks * (play->beat_len_ms / 4.0));
+    }
+    
+    return true;
+}
+
+u64 solver_get_safe_rows(struct Level *level, s32 x, s32 tick)
+{
+    u64 safe_rows = 0;
+    for (s32 y = 0; y < level->height; ++y)
+    {
+        if (!level_is_tile_deadly(level, x, y, tick)) safe_rows |= (u64)1 << y;
+    }
+    return safe_rows;
+}
+
+u64 solver_get_finish_rows(struct Level *level, s32 x)
+{
+    u64 finish_rows = 0;
+    for (s32 i = 0; i < level->finish_count; ++i)
+    {
+        if (level->finish[i].tile_x == x) finish_rows |= (u64)1 << level->finish[i].tile_y;
+    }
+    return finish_rows;
+}
+
+void profiler_begin_zone(struct Profiler *profiler, enum ProfileZone zone)
+{
+    profiler->zone_start_time_ms[zone] = js_get_time_ms();
+}
+
+void profiler_end_zone(struct Profiler *profiler, enum ProfileZone zone)
+{
+    profiler->zone_frame_time_ms[zone] += js_get_time_ms() - profiler->zone_start_time_ms[zone];
+}
+
+// Stores this frame's zone times as a new sample, overwriting the oldest one.
+void profiler_end_frame(struct Profiler *profiler)
+{
+    for (s32 zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
+    {
+        profiler->samples_ms[profiler->sample_write_idx][zone] = (f32)profiler->zone_frame_time_ms[zone];
+        profiler->zone_frame_time_ms[zone] = 0.0;
+    }
+    
+    profiler->sample_write_idx = (profiler->sample_write_idx + 1) % PROFILER_SAMPLE_COUNT;
+    if (profiler->sample_count < PROFILER_SAMPLE_COUNT) profiler->sample_count += 1;
+}
+
+void profiler_get_zone_stats(struct Profiler *profiler, enum ProfileZone zone, f32 *average_ms, f32 *max_ms)
+{
+    f32 total_ms = 0.f;
+    *max_ms = 0.f;
+    for (s32 i = 0; i < profiler->sample_count; ++i)
+    {
+        f32 sample_ms = profiler->samples_ms[i][zone];
+        total_ms += sample_ms;
+        if (sample_ms > *max_ms) *max_ms = sample_ms;
+    }
+    *average_ms = (profiler->sample_count > 0) ? total_ms / (f32)profiler->sample_count : 0.f;
+}
+
+// Writes the samples, oldest first, into the export storage as a NULL-terminated string. Times are
+// in whole microseconds, since StrBuf can't format floats.
+void profiler_export(struct Profiler *profiler, enum ProfilerExportFormat format, f64 *level_load_time_ms)
+{
+    struct StrBuf out;
+    strbuf_init(&out, profiler->export_storage, countof(profiler->export_storage));
+    s32 oldest_sample_idx = (profiler->sample_write_idx + PROFILER_SAMPLE_COUNT - profiler->sample_count) % PROFILER_SAMPLE_COUNT;
+    
+    if (format == PROFILER_EXPORT_FORMAT_JSON)
+    {
+        strbuf_printf(&out, "{\"sample_count\":%d,\"zones\":[", profiler->sample_count);
+        for (s32 zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
         {
-            // Skip this tile if it is completely outside the screen.
-            continue;
+            f32 average_ms;
+            f32 max_ms;
+            profiler_get_zone_stats(profiler, (enum ProfileZone)zone, &average_ms, &max_ms);
+            
+            if (zone > 0) strbuf_push_char(&out, ',');
+            strbuf_printf(&out, "{\"name\":\"%s\",\"average_us\":%d,\"max_us\":%d,\"samples_us\":[",
+                profile_zone_name[zone], math_round_f32_to_s32(average_ms * 1000.f), math_round_f32_to_s32(max_ms * 1000.f));
+            for (s32 i = 0; i < profiler->sample_count; ++i)
+            {
+                s32 sample_idx = (oldest_sample_idx + i) % PROFILER_SAMPLE_COUNT;
+                if (i > 0) strbuf_push_char(&out, ',');
+                strbuf_push_s32(&out, math_round_f32_to_s32(profiler->samples_ms[sample_idx][zone] * 1000.f));
+            }
+            strbuf_push_string(&out, "]}");
         }
         
-        if (current_level->spikes[i].is_up) draw_8x8_tile(IMAGE_ID_SPIKES_UP, pos_x, pos_y);
-        else draw_8x8_tile(IMAGE_ID_SPIKES_DOWN, pos_x, pos_y);
+        strbuf_push_string(&out, "],\"level_load_us\":[");
+        for (s32 level_idx = 0; level_idx < LEVEL_COUNT; ++level_idx)
+        {
+            if (level_idx > 0) strbuf_push_char(&out, ',');
+            strbuf_push_s32(&out, math_round_f32_to_s32((f32)level_load_time_ms[level_idx] * 1000.f));
+        }
+        strbuf_push_string(&out, "]}");
     }
     
-    // Draw moving blocks.
-    for (int i = 0; i < current_level->moving_blocks_count; ++i)
+    if (format == PROFILER_EXPORT_FORMAT_CSV)
     {
-        s32 pos_x = offset_x + (current_level->moving_blocks[i].entity.tile_x * 8);
-        s32 pos_y = offset_y + (current_level->moving_blocks[i].entity.tile_y * 8);
-        
-        if (pos_x < -8 || pos_y < -8 ||
-            pos_x >= CANVAS_WIDTH || pos_y >= CANVAS_HEIGHT)
+        // One row per frame, one column per zone. Level loads don't happen every frame, so they're left out.
+        for (s32 zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
         {
-            // Skip this tile if it is completely outside the screen.
-            continue;
+            if (zone > 0) strbuf_push_char(&out, ',');
+            strbuf_printf(&out, "%s_us", profile_zone_name[zone]);
         }
+        strbuf_push_char(&out, '\n');
         
-        draw_8x8_tile(IMAGE_ID_MOVING_BLOCK, pos_x, pos_y);
+        for (s32 i = 0; i < profiler->sample_count; ++i)
+        {
+            s32 sample_idx = (oldest_sample_idx + i) % PROFILER_SAMPLE_COUNT;
+            for (s32 zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
+            {
+                if (zone > 0) strbuf_push_char(&out, ',');
+                strbuf_push_s32(&out, math_round_f32_to_s32(profiler->samples_ms[sample_idx][zone] * 1000.f));
+            }
+            strbuf_push_char(&out, '\n');
+        }
     }
     
-    // Draw player.
+    profiler->export_length = out.length;
+}
+
+// Bucket 0 to 3 hold 0 to 3 microseconds. After that, bucket (e - 1) * 4 + m holds the times whose highest
+// set bit is e and whose next two bits are m.
+s32 telemetry_get_bucket(u32 time_us)
+{
+    if (time_us < 4) return (s32)time_us;
+    
+    s32 highest_bit = 2;
+    while (highest_bit < 31 && (time_us >> (highest_bit + 1)) != 0) highest_bit += 1;
+    s32 next_bits = (s32)(time_us >> (highest_bit - 2)) & 3;
+    
+    return math_min_s32((highest_bit - 1) * 4 + next_bits, TELEMETRY_BUCKET_COUNT - 1);
+}
+
+u32 telemetry_get_bucket_start_us(s32 bucket)
+{
+    if (bucket < 4) return (u32)bucket;
+    
+    s32 highest_bit = (bucket / 4) + 1;
+    u32 next_bits = (u32)(bucket % 4);
+    return (4 + next_bits) << (highest_bit - 2);
+}
+
+void telemetry_record_frame(struct Telemetry *telemetry, f64 duration_ms)
+{
+    u32 duration_us = (duration_ms > 0.0) ? (u32)(duration_ms * 1000.0) : 0;
+    
+    telemetry->frame_time_buckets[telemetry_get_bucket(duration_us)] += 1;
+    telemetry->frame_count += 1;
+    if (duration_us > TELEMETRY_FRAME_BUDGET_US) telemetry->over_budget_frame_count += 1;
+}
+
+void telemetry_record_ticks(struct Telemetry *telemetry, s32 tick_count)
+{
+    if (tick_count <= 1) return;
+    
+    telemetry->multi_tick_frame_count += 1;
+    telemetry->extra_tick_count += tick_count - 1;
+}
+
+void telemetry_record_audio_drift(struct Telemetry *telemetry, f64 drift_ms)
+{
+    f64 abs_drift_ms = (drift_ms < 0.0) ? -drift_ms : drift_ms;
+    
+    telemetry->audio_drift_total_ms += drift_ms;
+    if (abs_drift_ms > telemetry->max_audio_drift_ms) telemetry->max_audio_drift_ms = abs_drift_ms;
+    telemetry->audio_drift_sample_count += 1;
+}
+
+// Returns the upper end of the bucket the percentile falls in, so it never underestimates.
+s32 telemetry_get_frame_percentile_us(struct Telemetry *telemetry, s32 per_mille)
+{
+    if (telemetry->frame_count == 0) return 0;
+    
+    // Rounded up, so the 99.9th percentile of fewer than 1000 frames is the slowest frame.
+    s32 rank = (s32)(((s64)telemetry->frame_count * per_mille + 999) / 1000);
+    s32 seen_count = 0;
+    for (s32 bucket = 0; bucket < TELEMETRY_BUCKET_COUNT - 1; ++bucket)
     {
-        s32 pos_x = (player_tile_pos_x * 8) + offset_x;
-        s32 pos_y = (player_tile_pos_y * 8) + offset_y;
-        draw_8x8_tile(IMAGE_ID_PLAYER, pos_x, pos_y);
+        seen_count += telemetry->frame_time_buckets[bucket];
+        if (seen_count >= rank) return (s32)telemetry_get_bucket_start_us(bucket + 1) - 1;
     }
+    return (s32)telemetry_get_bucket_start_us(TELEMETRY_BUCKET_COUNT - 1);
 }
 
-void restart_level(void)
+void telemetry_summarize(struct Telemetry *telemetry, struct TelemetrySummary *summary)
 {
-    player_tick_capacitor = 0;
+    summary->frame_count = telemetry->frame_count;
+    summary->p50_frame_us = telemetry_get_frame_percentile_us(telemetry, 500);
+    summary->p99_frame_us = telemetry_get_frame_percentile_us(telemetry, 990);
+    summary->p999_frame_us = telemetry_get_frame_percentile_us(telemetry, 999);
+    summary->over_budget_frame_count = telemetry->over_budget_frame_count;
+    summary->multi_tick_frame_count = telemetry->multi_tick_frame_count;
+    summary->average_audio_drift_us = 0;
+    if (telemetry->audio_drift_sample_count > 0)
+    {
+        summary->average_audio_drift_us = (s32)(telemetry->audio_drift_total_ms * 1000.0 / telemetry->audio_drift_sample_count);
+    }
+    summary->max_audio_drift_us = (s32)(telemetry->max_audio_drift_ms * 1000.0);
+}
+
+void telemetry_save_summary(struct TelemetrySummary *summary)
+{
+    js_localstore_set_s32("squares_telemetry_frame_count", summary->frame_count);
+    js_localstore_set_s32("squares_telemetry_p50_frame_us", summary->p50_frame_us);
+    js_localstore_set_s32("squares_telemetry_p99_frame_us", summary->p99_frame_us);
+    js_localstore_set_s32("squares_telemetry_p999_frame_us", summary->p999_frame_us);
+    js_localstore_set_s32("squares_telemetry_over_budget_frame_count", summary->over_budget_frame_count);
+    js_localstore_set_s32("squares_telemetry_multi_tick_frame_count", summary->multi_tick_frame_count);
+    js_localstore_set_s32("squares_telemetry_average_audio_drift_us", summary->average_audio_drift_us);
+    js_localstore_set_s32("squares_telemetry_max_audio_drift_us", summary->max_audio_drift_us);
+}
+
+// Writes to local storage synchronously, so it's only called when a level ends and when the page is hidden.
+void telemetry_save(struct Telemetry *telemetry)
+{
+    struct TelemetrySummary summary;
+    telemetry_summarize(telemetry, &summary);
+    telemetry_save_summary(&summary);
+}
+
+void telemetry_load_summary(struct TelemetrySummary *summary)
+{
+    summary->frame_count = js_localstore_get_s32("squares_telemetry_frame_count");
+    summary->p50_frame_us = js_localstore_get_s32("squares_telemetry_p50_frame_us");
+    summary->p99_frame_us = js_localstore_get_s32("squares_telemetry_p99_frame_us");
+    summary->p999_frame_us = js_localstore_get_s32("squares_telemetry_p999_frame_us");
+    summary->over_budget_frame_count = js_localstore_get_s32("squares_telemetry_over_budget_frame_count");
+    summary->multi_tick_frame_count = js_localstore_get_s32("squares_telemetry_multi_tick_frame_count");
+    summary->average_audio_drift_us = js_localstore_get_s32("squares_telemetry_average_audio_drift_us");
+    summary->max_audio_drift_us = js_localstore_get_s32("squares_telemetry_max_audio_drift_us");
+}
+
+void telemetry_push_summary_json(struct StrBuf *out, struct TelemetrySummary *summary)
+{
+    strbuf_printf(out, "{\"frame_count\":%d,\"p50_frame_us\":%d,\"p99_frame_us\":%d,\"p999_frame_us\":%d,",
+        summary->frame_count, summary->p50_frame_us, summary->p99_frame_us, summary->p999_frame_us);
+    strbuf_printf(out, "\"over_budget_frame_count\":%d,\"multi_tick_frame_count\":%d,",
+        summary->over_budget_frame_count, summary->multi_tick_frame_count);
+    strbuf_printf(out, "\"average_audio_drift_us\":%d,\"max_audio_drift_us\":%d}",
+        summary->average_audio_drift_us, summary->max_audio_drift_us);
+}
+
+// Writes the summaries of this and the previous session and this session's histogram as JSON. Only
+// non-empty buckets are listed, as [start_us, count] pairs.
+void telemetry_export(struct Telemetry *telemetry)
+{
+    struct StrBuf out;
+    strbuf_init(&out, telemetry->export_storage, countof(telemetry->export_storage));
     
-    for (int i = 0; i < current_level->finish_count; ++i) current_level->finish[i].tick_capacitor = 0;
+    struct TelemetrySummary summary;
+    telemetry_summarize(telemetry, &summary);
     
-    for (int i = 0; i < current_level->spikes_count; ++i)
+    strbuf_push_string(&out, "{\"session\":");
+    telemetry_push_summary_json(&out, &summary);
+    strbuf_push_string(&out, ",\"previous_session\":");
+    telemetry_push_summary_json(&out, &telemetry->previous_session);
+    strbuf_printf(&out, ",\"extra_tick_count\":%d,\"frame_time_buckets\":[", telemetry->extra_tick_count);
+    
+    bool is_first_bucket = true;
+    for (s32 bucket = 0; bucket < TELEMETRY_BUCKET_COUNT; ++bucket)
     {
-        current_level->spikes[i].entity.tick_capacitor = 0;
-        current_level->spikes[i].is_up = current_level->spikes[i].is_up_start;
+        if (telemetry->frame_time_buckets[bucket] == 0) continue;
+        
+        if (!is_first_bucket) strbuf_push_char(&out, ',');
+        strbuf_printf(&out, "[%d,%d]", (s32)telemetry_get_bucket_start_us(bucket), (s32)telemetry->frame_time_buckets[bucket]);
+        is_first_bucket = false;
     }
+    strbuf_push_string(&out, "]}");
     
-    for (int i = 0; i < current_level->moving_blocks_count; ++i)
+    telemetry->export_length = out.length;
+}
+
+// Keeps this frame's counters for exporting, and tallies how many pixels were drawn how many times.
+void render_stats_end_frame(struct RenderStats *render_stats, s32 pixel_count)
+{
+    mem_copy(render_stats->last_frame, render_stats->frame.function, sizeof(render_stats->last_frame));
+    
+    mem_set_s32(render_stats->last_frame_overdraw, VIDEO_OVERDRAW_LEVELS, 0);
+    for (s32 i = 0; i < pixel_count; ++i)
     {
-        current_level->moving_blocks[i].entity.tick_capacitor = 0;
-        current_level->moving_blocks[i].entity.tile_x = current_level->moving_blocks[i].tile_x_start;
-        current_level->moving_blocks[i].entity.tile_y = current_level->moving_blocks[i].tile_y_start;
-        current_level->moving_blocks[i].y_direction = current_level->moving_blocks[i].y_direction_start;
+        render_stats->last_frame_overdraw[video_stats_get_overdraw_level(render_stats->frame.overdraw[i])] += 1;
     }
+}
+
+void render_stats_export(struct RenderStats *render_stats)
+{
+    struct StrBuf out;
+    strbuf_init(&out, render_stats->export_storage, countof(render_stats->export_storage));
+    
+#if VIDEO_COUNT_STATS
+    strbuf_push_string(&out, "{\"functions\":[");
+    for (s32 function = 0; function < VIDEO_FUNCTION_COUNT; ++function)
+    {
+        struct VideoFunctionStats *stats = &render_stats->last_frame[function];
+        if (function > 0) strbuf_push_char(&out, ',');
+        strbuf_printf(&out, "{\"name\":\"%s\",\"calls\":%d,\"clipped_away\":%d,\"pixels_copied\":%d,\"pixels_blended\":%d,\"pixels_skipped\":%d}",
+            video_function_name[function], stats->call_count, stats->clipped_away_count, stats->pixels_copied, stats->pixels_blended, stats->pixels_skipped);
+    }
+    
+    strbuf_push_string(&out, "],\"overdraw_pixels\":[");
+    for (s32 level = 0; level < VIDEO_OVERDRAW_LEVELS; ++level)
+    {
+        if (level > 0) strbuf_push_char(&out, ',');
+        strbuf_push_s32(&out, render_stats->last_frame_overdraw[level]);
+    }
+    strbuf_push_string(&out, "]}");
+#else
+    strbuf_push_string(&out, "null");
+#endif
     
-    player_tile_pos_x = current_level->player_pos_start_x;
-    player_tile_pos_y = current_level->player_pos_start_y;
+    render_stats->export_length = out.length;
+}
+
+// Draws the average time of each zone over the last samples in hundredths of a millisecond, as the
+// canvas only fits a few characters per line.
+void draw_profiler_overlay(struct GameContext *game)
+{
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_OVERLAYS);
+    
+    struct Color background_color = {0, 0, 0, 160};
+    video_draw_rect(&game->framebuffer, 0, 0, game->framebuffer.width, PROFILE_ZONE_COUNT * 8, background_color);
     
-    camera_pos_x = (f32)((player_tile_pos_x * 8) - (CANVAS_WIDTH / 2 - 4));
-    camera_pos_y = (f32)((player_tile_pos_y * 8) - (CANVAS_HEIGHT / 2 - 4));
+    for (s32 zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
+    {
+        f32 average_ms;
+        f32 max_ms;
+        profiler_get_zone_stats(&game->profiler, (enum ProfileZone)zone, &average_ms, &max_ms);
+        
+        s32 hundredths = math_round_f32_to_s32(average_ms * 100.f);
+        char line_storage[16];
+        struct StrBuf line;
+        strbuf_init(&line, line_storage, countof(line_storage));
+        strbuf_printf(&line, "%s %d.%d%d", profile_zone_label[zone], hundredths / 100, (hundredths / 10) % 10, hundredths % 10);
+        
+        // Turn red when a zone alone takes up the whole frame budget at 60 frames per second.
+        struct Color text_color = (max_ms > 1000.f / 60.f) ? video_make_color(220, 60, 60) : video_make_color(255, 255, 255);
+        video_draw_text_colored(&game->framebuffer, &font[FONT_ID_SMALL], strbuf_get(&line), 1, zone * 8, TEXT_ALIGN_LEFT, text_color);
+    }
     
-    js_audio_play(audio[current_level_music_audio_id]);
-    level_start_time_ms = js_get_time_ms();
-    //level_start_time_ms = 0;
-    //level_start_time_ms = js_audio_get_time(audio[AUDIO_ID_LEVEL_1_SONG]);
-    last_tick_time_ms = (f32)level_start_time_ms;
-    //last_tick_time_ms = 0;
-    //sync_offset_ms = 0;
-    //last_sync_time_ms = 0;
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_OVERLAYS);
 }
 
-void draw_8x8_tile(enum ImageId image_id, s32 x, s32 y)
+void draw_8x8_tile(struct Image *framebuffer, enum ImageId image_id, s32 x, s32 y)
 {
     video_blit(
-        &framebuffer,
+        framebuffer,
         &image[image_id],
         x,
         y,
@@ -930,85 +2597,228 @@ void draw_8x8_tile(enum ImageId image_id, s32 x, s32 y)
         BLIT_FLIP_NONE);
 }
 
-bool *get_level_wall_at_pos(s32 x, s32 y)
+bool *get_level_wall_at_pos(struct Level *level, s32 x, s32 y)
 {
-    s32 idx = y * current_level->width + x;
-    if (current_level->walls[idx]) return &current_level->walls[idx];
+    s32 idx = y * level->width + x;
+    if (level->walls[idx]) return &level->walls[idx];
     else return NULL;
 }
 
-struct LevelSpike *get_level_spike_at_pos(s32 x, s32 y)
+// Returns the index of the spike at the position, or -1.
+s32 get_level_spike_at_pos(struct Level *level, s32 x, s32 y)
 {
-    for (int i = 0; i < current_level->spikes_count; ++i)
+    if (x < 0 || x >= level->width) return -1;
+    
+    for (s32 i = level->spikes.column_start[x]; i < level->spikes.column_start[x + 1]; ++i)
     {
-        if (current_level->spikes[i].entity.tile_x == x &&
-            current_level->spikes[i].entity.tile_y == y)
-        {
-            return &current_level->spikes[i];
-        }
+        if (level->spikes.tile_y[i] == y) return i;
     }
-    return NULL;
+    return -1;
 }
 
-struct LevelMovingBlock *get_level_moving_block_at_pos(s32 x, s32 y)
+// Returns the index of the moving block at the position on the given tick, or -1.
+s32 get_level_moving_block_at_pos(struct Level *level, s32 x, s32 y, s32 tick)
 {
-    for (int i = 0; i < current_level->moving_blocks_count; ++i)
+    if (x < 0 || x >= level->width) return -1;
+    
+    for (s32 i = level->moving_blocks.column_start[x]; i < level->moving_blocks.column_start[x + 1]; ++i)
     {
-        if (current_level->moving_blocks[i].entity.tile_x == x &&
-            current_level->moving_blocks[i].entity.tile_y == y)
-        {
-            return &current_level->moving_blocks[i];
-        }
+        if (level_moving_block_get_tile_y(&level->moving_blocks, i, tick) == y) return i;
     }
-    return NULL;
+    return -1;
 }
 
-struct LevelEntity *get_level_finish_at_pos(s32 x, s32 y)
+struct LevelEntity *get_level_finish_at_pos(struct Level *level, s32 x, s32 y)
 {
-    for (int i = 0; i < current_level->finish_count; ++i)
+    for (int i = 0; i < level->finish_count; ++i)
     {
-        if (current_level->finish[i].tile_x == x &&
-            current_level->finish[i].tile_y == y)
+        if (level->finish[i].tile_x == x &&
+            level->finish[i].tile_y == y)
         {
-            return &current_level->finish[i];
+            return &level->finish[i];
         }
     }
     return NULL;
 }
 
-void draw_menu_bg(void)
+// Puts back the cached screen if it was stored with the same key in this state. Returns false if
+// the screen has to be drawn. The framebuffer is kept between frames, so it's only copied when
+// something else has been drawn over it since.
+bool draw_from_frame_cache(struct GameContext *game, u32 key)
+{
+    struct FrameCache *cache = &game->frame_cache;
+    if (!cache->is_valid || cache->key != key) return false;
+    
+    if (game->is_full_redraw_needed)
+    {
+        profiler_begin_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+        video_copy_image(&game->framebuffer, &cache->image);
+        profiler_end_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+    }
+    return true;
+}
+
+// Call once the screen has been drawn, before anything that changes every frame is drawn over it.
+void frame_cache_store(struct GameContext *game, u32 key)
 {
-    static float pos = 0.f;
+    struct FrameCache *cache = &game->frame_cache;
+    mem_copy(cache->image.data, game->framebuffer.data, image_calculate_size(&game->framebuffer));
+    cache->key = key;
+    cache->is_valid = true;
+}
+
+void draw_clear(struct GameContext *game, struct Color color)
+{
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+    video_clear_framebuffer(&game->framebuffer, color);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+}
+
+void draw_clear_rect(struct GameContext *game, s32 x, s32 y, s32 w, s32 h, struct Color color)
+{
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+    color.a = 255;
+    video_draw_rect(&game->framebuffer, x, y, w, h, color);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+}
+
+// Blends a color over everything drawn so far, for when what's drawn after it shouldn't be covered.
+// Otherwise the post process does the same at the end of the frame.
+void draw_overlay(struct GameContext *game, struct Color color)
+{
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_OVERLAYS);
+    video_apply_color_lut(&game->framebuffer, post_process_get_lut(&game->post_process, color));
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_OVERLAYS);
+}
+
+struct VideoColorLut *post_process_get_lut(struct PostProcess *post_process, struct Color color)
+{
+    struct Color built = post_process->lut.color;
+    if (!post_process->is_lut_built || built.r != color.r || built.g != color.g || built.b != color.b || built.a != color.a)
+    {
+        video_color_lut_build(&post_process->lut, color);
+        post_process->is_lut_built = true;
+    }
+    return &post_process->lut;
+}
+
+void post_process_end_frame(struct GameContext *game)
+{
+    struct PostProcess *post_process = &game->post_process;
+    post_process->was_applied = post_process->color.a != 0;
+    if (!post_process->was_applied) return;
     
-    pos -= 30.f * delta_time_s;
-    if (pos < -24.f) pos += 24.f;
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_OVERLAYS);
+    video_apply_color_lut(&game->framebuffer, post_process_get_lut(post_process, post_process->color));
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_OVERLAYS);
+}
+
+void draw_text(struct GameContext *game, const char *str, s32 x, s32 y, enum TextAlign align)
+{
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_TEXT);
+    video_draw_text_cached(&game->framebuffer, &game->text_cache, &font[FONT_ID_SMALL], str, x, y, align);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_TEXT);
+}
+
+void draw_text_colored(struct GameContext *game, const char *str, s32 x, s32 y, enum TextAlign align, struct Color color)
+{
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_TEXT);
+    video_draw_text_colored(&game->framebuffer, &font[FONT_ID_SMALL], str, x, y, align, color);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_TEXT);
+}
+
+void menu_build_images(s32 canvas_width)
+{
+    struct Color overlay_color = {0, 0, 0, 194};
+    
+    struct Image *pattern = &menu_bg_pattern;
+    pattern->width = ((canvas_width + MENU_BG_TILE_SIZE - 1) / MENU_BG_TILE_SIZE) * MENU_BG_TILE_SIZE;
+    pattern->height = MENU_BG_TILE_SIZE;
+    pattern->alpha = IMAGE_ALPHA_OPAQUE;
+    pattern->data = mem_alloc(image_calculate_size(pattern));
+    ASSERT(pattern->data != NULL);
+    
+    video_clear_framebuffer(pattern, video_make_color(0, 0, 0));
+    for (s32 x = 0; x < pattern->width; x += MENU_BG_TILE_SIZE)
+    {
+        video_blit(pattern, &image[IMAGE_ID_MENU_BG], x, 0, 0, 0, MENU_BG_TILE_SIZE, MENU_BG_TILE_SIZE, BLIT_FLIP_NONE);
+    }
+    video_draw_rect(pattern, 0, 0, pattern->width, pattern->height, overlay_color);
+    
+    // Darken the hog's colors the same way, but keep its alpha. Its colors are premultiplied, so
+    // scaling them darkens it just the same.
+    struct Image *hog = &image[IMAGE_ID_HOG];
+    hog_darkened.width = hog->width;
+    hog_darkened.height = hog->height;
+    hog_darkened.alpha = hog->alpha;
+    hog_darkened.data = mem_alloc(image_calculate_size(hog));
+    ASSERT(hog_darkened.data != NULL);
+    
+    u8 *src = (u8 *)hog->data;
+    u8 *dest = (u8 *)hog_darkened.data;
+    f32 percent = 1.f - (f32)overlay_color.a / 255.f;
+    for (s32 i = 0; i < image_calculate_size(hog); i += 4)
+    {
+        dest[i + 0] = (u8)((f32)src[i + 0] * percent);
+        dest[i + 1] = (u8)((f32)src[i + 1] * percent);
+        dest[i + 2] = (u8)((f32)src[i + 2] * percent);
+        dest[i + 3] = src[i + 3];
+    }
+}
+
+// Level images are read as data rather than drawn, and the menu background and hog are only drawn
+// through the images built from them, so none of those are converted.
+void convert_images_to_indexed(struct VideoPalette *palette)
+{
+    static const enum ImageId drawn_image_ids[] = {
+        IMAGE_ID_WALL_1,
+        IMAGE_ID_WALL_2,
+        IMAGE_ID_WALL_3,
+        IMAGE_ID_WALL_4,
+        IMAGE_ID_PLAYER,
+        IMAGE_ID_FINISH,
+        IMAGE_ID_MOVING_BLOCK,
+        IMAGE_ID_SPIKES_DOWN,
+        IMAGE_ID_SPIKES_UP,
+        IMAGE_ID_YYAM,
+    };
+    for (s32 i = 0; i < (s32)countof(drawn_image_ids); ++i)
+    {
+        image_convert_to_indexed(&image[drawn_image_ids[i]], palette);
+    }
+    image_convert_to_indexed(&menu_bg_pattern, palette);
+    image_convert_to_indexed(&hog_darkened, palette);
+}
+
+// The row the 64 pixel tall layout of the menus and messages starts at.
+s32 layout_get_top(struct GameContext *game)
+{
+    return (game->framebuffer.height - LAYOUT_HEIGHT) / 2;
+}
+
+// Covers the whole screen, so there's no need to clear it first.
+void draw_menu_bg(struct GameContext *game)
+{
+    game->menu_bg_pos -= 30.f * game->delta_time_s;
+    if (game->menu_bg_pos < -24.f) game->menu_bg_pos += 24.f;
+    s32 pos = (s32)game->menu_bg_pos;
+    
+    profiler_begin_zone(&game->profiler, PROFILE_ZONE_CLEAR);
+    video_fill_tiled(&game->framebuffer, &menu_bg_pattern, -pos, -pos);
+    profiler_end_zone(&game->profiler, PROFILE_ZONE_CLEAR);
     
-    if (hog_pos < 100.f)
+    if (game->hog_pos < 100.f)
     {
-        hog_pos += 40.f * delta_time_s;
+        game->hog_pos += 40.f * game->delta_time_s;
         video_blit(
-            &framebuffer,
-            &image[IMAGE_ID_HOG],
-            (s32)hog_pos,
-            (s32)hog_pos,
+            &game->framebuffer,
+            &hog_darkened,
+            (s32)game->hog_pos,
+            (s32)game->hog_pos,
             0,
             0,
             20,
             20,
             BLIT_FLIP_NONE);
     }
-    
-    video_blit(
-        &framebuffer,
-        &image[IMAGE_ID_MENU_BG],
-        (s32)pos,
-        (s32)pos,
-        0,
-        0,
-        88,
-        88,
-        BLIT_FLIP_NONE);
-    
-    struct Color overlay_color = {0, 0, 0, 194};
-    video_draw_rect(&framebuffer, 0, 0, 64, 64, overlay_color);
 }
\ No newline at end of file
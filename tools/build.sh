@@ -30,7 +30,25 @@ wasm-ld llvm_bitfile_squares.bc llvm_bitfile_shared.bc \
     --export js_on_startup \
     --export js_on_frame \
     --export js_on_keyboard_event \
-    --export js_on_image_loaded
+    --export js_on_image_loaded \
+    --export js_on_image_ready \
+    --export js_get_level_load_time_ms \
+    --export js_replay_get_recording \
+    --export js_replay_get_recording_size \
+    --export js_replay_get_playback_buffer \
+    --export js_replay_verify \
+    --export js_simulate_ticks \
+    --export js_solve_level \
+    --export js_solver_get_winning_path_count \
+    --export js_solver_get_reaction_window_ms \
+    --export js_solver_get_solve_time_ms \
+    --export js_profiler_export \
+    --export js_profiler_get_export_length \
+    --export js_on_page_hide \
+    --export js_telemetry_export \
+    --export js_telemetry_get_export_length \
+    --export js_render_stats_export \
+    --export js_render_stats_get_export_length
 
 echo Done!
 echo Copying files...
@@ -0,0 +1,449 @@
+// Native stand-in for index.html, used by host_test.sh to run the game without a browser.
+// Assets are generated from a fixed seed and keys are pressed on a fixed schedule, so a run prints the
+// same checksum of the framebuffer every time unless the rendering changes.
+//
+// Usage: host_test <frame_count> [options]
+//   --resolution N        Index into canvas_resolutions, read through the squares_resolution key.
+//   --alpha KIND          Sprite alpha: blended (default), binary or opaque. The font is always binary.
+//   --late-input-ms N     Stamp key events N ms before the frame that handles them.
+//   --verify-replays      Verify each recorded session with js_replay_verify as soon as it ends.
+//   --solve               Solve every level with 3 seeds once the game has loaded.
+//   --level-size WxH      Size of the generated levels, 160x16 by default.
+//   --level-density N     About 15 in N level tiles are walls or entities, 100 by default.
+//   --save-frames FILE    Write every frame's pixels to a file or pipe.
+//   --compare-frames FILE Compare every frame's pixels to ones written by --save-frames.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#undef NULL
+#include "js.h"
+
+#define HOST_FRAME_TIME_MS 16.0
+#define HOST_KEY_INTERVAL_FRAMES 7
+#define HOST_ESCAPE_INTERVAL_FRAMES 700
+#define HOST_SOLVE_FRAME 1500
+#define HOST_MAX_REPLAY_SIZE (64 * 1024)
+
+// Exports that older revisions of the game don't have. Calls to them are skipped when they are missing.
+__attribute__((weak)) void js_on_image_ready(s32 id);
+__attribute__((weak)) u8 *js_replay_get_recording(void);
+__attribute__((weak)) s32 js_replay_get_recording_size(void);
+__attribute__((weak)) u8 *js_replay_get_playback_buffer(void);
+__attribute__((weak)) s32 js_replay_verify(s32 size);
+__attribute__((weak)) s32 js_solve_level(s32 level_idx, u32 rng_seed);
+__attribute__((weak)) f64 js_solver_get_winning_path_count(void);
+__attribute__((weak)) f64 js_solver_get_reaction_window_ms(void);
+
+enum HostAlpha
+{
+    HOST_ALPHA_BLENDED,
+    HOST_ALPHA_BINARY,
+    HOST_ALPHA_OPAQUE,
+};
+
+struct HostOptions
+{
+    s32 frame_count;
+    s32 resolution_idx;
+    enum HostAlpha alpha;
+    f64 late_input_ms;
+    bool is_verifying_replays;
+    bool is_solving;
+    s32 level_width;
+    s32 level_height;
+    u32 level_density;
+    const char *save_frames_path;
+    const char *compare_frames_path;
+};
+
+// The WASM linker places the heap after the game's static data. Natively it's just a large array.
+unsigned char __heap_base[32 * 1024 * 1024];
+
+static struct HostOptions options = {
+    .frame_count = 3000,
+    .alpha = HOST_ALPHA_BLENDED,
+    .level_width = 160,
+    .level_height = 16,
+    .level_density = 100,
+};
+static f64 time_now_ms = 0.0;
+static u32 asset_rng_seed = 99;
+static s32 asset_loaded_count = 0;
+static s32 audio_count = 0;
+static bool is_asserting = false;
+static u8 *framebuffer = NULL;
+static s32 framebuffer_width = 64;
+static s32 framebuffer_height = 64;
+static u8 screen[4 * 1024 * 1024]; // What js_present_rows has copied to the "canvas" so far.
+static u8 reference_frame[4 * 1024 * 1024];
+
+static u32 host_rng_next(u32 *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void host_set_pixel(u8 *data, s32 width, s32 x, s32 y, u32 r, u32 g, u32 b, u32 a)
+{
+    u8 *pixel = &data[(y * width + x) * 4];
+    pixel[0] = (u8)r;
+    pixel[1] = (u8)g;
+    pixel[2] = (u8)b;
+    pixel[3] = (u8)a;
+}
+
+// Walls, spikes, moving blocks and a finish in the colors the level parser looks for.
+static void host_generate_level(u8 *data, s32 width, s32 height)
+{
+    for (s32 y = 0; y < height; ++y)
+    {
+        for (s32 x = 0; x < width; ++x)
+        {
+            u32 r = 0, g = 0, b = 0;
+            if (y == 0 || y == height - 1)
+            {
+                r = g = b = 255;
+            }
+            else if (x == width - 3 && y < 30)
+            {
+                r = 36; g = 123; b = 21;
+            }
+            else if (x > 4 && x < width - 3)
+            {
+                u32 v = host_rng_next(&asset_rng_seed) % options.level_density;
+                if (v < 6) { r = g = b = 255; }
+                else if (v < 9) { r = g = b = 127; }
+                else if (v < 12) { r = g = b = 195; }
+                else if (v < 13) { r = 255; g = 218; b = 91; }
+                else if (v < 14) { r = 138; g = 107; b = 0; }
+                else if (v < 15) { r = 255; g = 201; b = 14; }
+            }
+            if (x == 1 && y == 8) { r = 34; g = 177; b = 76; }
+            host_set_pixel(data, width, x, y, r, g, b, 255);
+        }
+    }
+}
+
+static void host_generate_sprite(u8 *data, s32 width, s32 height, bool is_font)
+{
+    for (s32 y = 0; y < height; ++y)
+    {
+        for (s32 x = 0; x < width; ++x)
+        {
+            u32 v = host_rng_next(&asset_rng_seed);
+            if (is_font)
+            {
+                host_set_pixel(data, width, x, y, 255, 255, 255, (v & 3) == 0 ? 255 : 0);
+                continue;
+            }
+            
+            u32 a = (v >> 24) & 0xff;
+            if ((v & 7) == 0) a = 0;
+            if ((v & 7) == 1) a = 255;
+            if (options.alpha == HOST_ALPHA_BINARY) a = (a < 128) ? 0 : 255;
+            if (options.alpha == HOST_ALPHA_OPAQUE) a = 255;
+            host_set_pixel(data, width, x, y, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, a);
+        }
+    }
+}
+
+// Imports
+
+// An assert prints its message, file name and line number, then spins forever. The host stops after the line number.
+void js_print(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    if (strcmp(msg, "WASM Assert triggered!") == 0) is_asserting = true;
+}
+
+void js_print_number(s32 number)
+{
+    fprintf(stderr, "%d\n", number);
+    if (is_asserting) exit(1);
+}
+
+void js_show_alert(const char *msg) { printf("alert %s\n", msg); }
+
+f64 js_get_time_ms(void) { return time_now_ms; }
+u32 js_get_unix_time(void) { return 12345; }
+
+void js_canvas_resize(s32 w, s32 h, f32 scale)
+{
+    (void)scale;
+    framebuffer_width = w;
+    framebuffer_height = h;
+}
+
+void js_set_framebuffer(void *address) { framebuffer = address; }
+
+void js_present_rows(s32 first_row, s32 row_count)
+{
+    s32 row_size = framebuffer_width * 4;
+    memcpy(&screen[first_row * row_size], &framebuffer[first_row * row_size], row_count * row_size);
+}
+
+void js_asset_load_image(const char *url, s32 id)
+{
+    s32 width = 8, height = 8;
+    bool is_level = strstr(url, "level") != NULL;
+    bool is_font = strstr(url, "font") != NULL;
+    if (is_font) { width = 96 * 6; height = 8; }
+    else if (is_level) { width = options.level_width; height = options.level_height; }
+    else if (strstr(url, "menu_bg")) { width = 88; height = 88; }
+    else if (strstr(url, "hog")) { width = 20; height = 20; }
+    else if (strstr(url, "yyam")) { width = 30; height = 7; }
+    
+    u8 *data = js_on_image_loaded(id, width, height);
+    if (is_level) host_generate_level(data, width, height);
+    else host_generate_sprite(data, width, height, is_font);
+    
+    if (js_on_image_ready) js_on_image_ready(id);
+    asset_loaded_count += 1;
+}
+
+s32 js_asset_load_audio(const char *url)
+{
+    (void)url;
+    asset_loaded_count += 1;
+    return audio_count++;
+}
+
+s32 js_asset_count_loaded(void) { return asset_loaded_count; }
+
+void js_audio_play(s32 id) { (void)id; }
+void js_audio_pause(s32 id) { (void)id; }
+void js_audio_stop(s32 id) { (void)id; }
+f64 js_audio_get_time(s32 id) { (void)id; return 0.0; }
+void js_audio_set_time(s32 id, f64 time_ms) { (void)id; (void)time_ms; }
+
+// Nothing is saved, so every run starts from a fresh profile.
+void js_localstore_set_s32(const char *key, s32 value) { (void)key; (void)value; }
+s32 js_localstore_get_s32(const char *key)
+{
+    if (strcmp(key, "squares_resolution") == 0) return options.resolution_idx;
+    return 0;
+}
+
+static void host_send_key(s32 key_code, s32 new_state)
+{
+    js_on_keyboard_event(key_code, new_state, time_now_ms - options.late_input_ms);
+}
+
+// Verifies the last recorded session once it's new. Returns false if a session failed to verify.
+static bool host_verify_replay(void)
+{
+    static u8 last_recording[HOST_MAX_REPLAY_SIZE];
+    static s32 last_recording_size = 0;
+    static bool is_pending = false;
+    
+    s32 size = js_replay_get_recording_size();
+    if (size <= 0 || size > HOST_MAX_REPLAY_SIZE) return true;
+    if (size != last_recording_size || memcmp(last_recording, js_replay_get_recording(), size) != 0)
+    {
+        memcpy(last_recording, js_replay_get_recording(), size);
+        last_recording_size = size;
+        is_pending = true;
+    }
+    if (!is_pending) return true;
+    
+    memcpy(js_replay_get_playback_buffer(), last_recording, size);
+    s32 verified = js_replay_verify(size);
+    if (verified < 0) return true; // Not ready to run yet, try again next frame.
+    
+    is_pending = false;
+    printf("verify %d result=%d\n", verified, last_recording[6]);
+    return verified == 1;
+}
+
+static void host_solve_levels(void)
+{
+    for (s32 level_idx = 0; level_idx < 4; ++level_idx)
+    {
+        for (u32 seed = 1; seed <= 3; ++seed)
+        {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            s32 result = js_solve_level(level_idx, seed * 12345);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            
+            f64 wall_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+            printf("solve level %d seed %u: %d paths=%g window=%gms wall=%.3fms\n",
+                level_idx, seed, result, js_solver_get_winning_path_count(), js_solver_get_reaction_window_ms(), wall_ms);
+        }
+    }
+}
+
+// Frames are saved as their width and height followed by their pixels.
+static void host_save_frame(FILE *file)
+{
+    s32 size[2] = {framebuffer_width, framebuffer_height};
+    fwrite(size, sizeof(size), 1, file);
+    fwrite(framebuffer, 1, framebuffer_width * framebuffer_height * 4, file);
+}
+
+// Returns the largest difference of any channel of any pixel, or -1 if the saved frame is missing or
+// a different size.
+static s32 host_compare_frame(FILE *file)
+{
+    s32 saved_size[2];
+    if (fread(saved_size, sizeof(saved_size), 1, file) != 1) return -1;
+    if (saved_size[0] != framebuffer_width || saved_size[1] != framebuffer_height) return -1;
+    
+    s32 size = framebuffer_width * framebuffer_height * 4;
+    if (fread(reference_frame, 1, size, file) != (size_t)size) return -1;
+    
+    s32 max_difference = 0;
+    for (s32 i = 0; i < size; ++i)
+    {
+        s32 difference = abs((s32)framebuffer[i] - (s32)reference_frame[i]);
+        if (difference > max_difference) max_difference = difference;
+    }
+    return max_difference;
+}
+
+static u32 host_hash(u8 *data, s32 size)
+{
+    // FNV-1a
+    u32 hash = 2166136261u;
+    for (s32 i = 0; i < size; ++i)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool host_parse_options(int argc, char **argv)
+{
+    if (argc < 2) return false;
+    options.frame_count = atoi(argv[1]);
+    
+    for (int i = 2; i < argc; ++i)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--resolution") == 0 && has_value) options.resolution_idx = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--late-input-ms") == 0 && has_value) options.late_input_ms = atof(argv[++i]);
+        else if (strcmp(argv[i], "--verify-replays") == 0) options.is_verifying_replays = true;
+        else if (strcmp(argv[i], "--solve") == 0) options.is_solving = true;
+        else if (strcmp(argv[i], "--save-frames") == 0 && has_value) options.save_frames_path = argv[++i];
+        else if (strcmp(argv[i], "--compare-frames") == 0 && has_value) options.compare_frames_path = argv[++i];
+        else if (strcmp(argv[i], "--level-density") == 0 && has_value) options.level_density = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--level-size") == 0 && has_value)
+        {
+            if (sscanf(argv[++i], "%dx%d", &options.level_width, &options.level_height) != 2) return false;
+        }
+        else if (strcmp(argv[i], "--alpha") == 0 && has_value)
+        {
+            i += 1;
+            if (strcmp(argv[i], "blended") == 0) options.alpha = HOST_ALPHA_BLENDED;
+            else if (strcmp(argv[i], "binary") == 0) options.alpha = HOST_ALPHA_BINARY;
+            else if (strcmp(argv[i], "opaque") == 0) options.alpha = HOST_ALPHA_OPAQUE;
+            else return false;
+        }
+        else return false;
+    }
+    
+    return options.level_density > 0;
+}
+
+// Prints one line per verified replay and solve, then the number of frames where the presented rows
+// didn't match the framebuffer, how far the frames were from the compared ones and a checksum of every
+// frame. Exits with 1 if a replay didn't verify, a presented row didn't match or a compared frame differed.
+int main(int argc, char **argv)
+{
+    if (!host_parse_options(argc, argv))
+    {
+        fprintf(stderr, "usage: %s <frame_count> [--resolution N] [--alpha blended|binary|opaque] [--late-input-ms N] [--verify-replays] [--solve] [--level-size WxH] [--level-density N] [--save-frames FILE] [--compare-frames FILE]\n", argv[0]);
+        return 2;
+    }
+    if (options.is_verifying_replays && !js_replay_verify)
+    {
+        fprintf(stderr, "this revision has no replays\n");
+        return 2;
+    }
+    if (options.is_solving && !js_solve_level)
+    {
+        fprintf(stderr, "this revision has no solver\n");
+        return 2;
+    }
+    
+    FILE *save_frames_file = NULL;
+    FILE *compare_frames_file = NULL;
+    if (options.save_frames_path) save_frames_file = fopen(options.save_frames_path, "wb");
+    if (options.compare_frames_path) compare_frames_file = fopen(options.compare_frames_path, "rb");
+    if ((options.save_frames_path && !save_frames_file) || (options.compare_frames_path && !compare_frames_file))
+    {
+        fprintf(stderr, "can't open the frames file\n");
+        return 2;
+    }
+    
+    js_on_startup();
+    
+    bool is_ok = true;
+    u32 checksum = 0;
+    s32 mismatched_frame_count = 0;
+    s32 differing_frame_count = 0;
+    s32 max_channel_difference = 0;
+    u32 key_rng_seed = 7;
+    for (s32 frame = 0; frame < options.frame_count; ++frame)
+    {
+        // Frames are uneven, like they are in the browser.
+        time_now_ms += HOST_FRAME_TIME_MS + (frame % 3);
+        
+        u32 key_roll = host_rng_next(&key_rng_seed);
+        s32 key_code = -1;
+        if (frame % HOST_KEY_INTERVAL_FRAMES == 0)
+        {
+            s32 keys[] = {
+                JS_KEY_CODE_UP, JS_KEY_CODE_DOWN, JS_KEY_CODE_UP, JS_KEY_CODE_DOWN, JS_KEY_CODE_ENTER,
+                JS_KEY_CODE_RIGHT, JS_KEY_CODE_LEFT, JS_KEY_CODE_SPACE, JS_KEY_CODE_ESCAPE, JS_KEY_CODE_ENTER,
+                JS_KEY_CODE_ENTER, JS_KEY_CODE_UP, JS_KEY_CODE_DOWN,
+            };
+            key_code = keys[key_roll % (sizeof(keys) / sizeof(keys[0]))];
+            if (frame % HOST_ESCAPE_INTERVAL_FRAMES == 0) key_code = JS_KEY_CODE_ESCAPE;
+            host_send_key(key_code, 1);
+        }
+        
+        js_on_frame();
+        
+        if (key_code >= 0) host_send_key(key_code, 0);
+        if (options.is_verifying_replays && !host_verify_replay()) is_ok = false;
+        if (options.is_solving && frame == HOST_SOLVE_FRAME) host_solve_levels();
+        
+        s32 framebuffer_size = framebuffer_width * framebuffer_height * 4;
+        if (memcmp(screen, framebuffer, framebuffer_size) != 0) mismatched_frame_count += 1;
+        checksum = checksum * 31 + host_hash(framebuffer, framebuffer_size);
+        
+        if (save_frames_file) host_save_frame(save_frames_file);
+        if (compare_frames_file)
+        {
+            s32 difference = host_compare_frame(compare_frames_file);
+            if (difference != 0) differing_frame_count += 1;
+            if (difference < 0)
+            {
+                printf("compared frames end or are a different size from frame %d\n", frame);
+                fclose(compare_frames_file);
+                compare_frames_file = NULL;
+            }
+            if (difference > max_channel_difference) max_channel_difference = difference;
+        }
+    }
+    
+    if (save_frames_file) fclose(save_frames_file);
+    if (options.compare_frames_path)
+    {
+        if (compare_frames_file) fclose(compare_frames_file);
+        if (differing_frame_count > 0) is_ok = false;
+        printf("compare_differing_frames %d max_channel_difference %d\n", differing_frame_count, max_channel_difference);
+    }
+    
+    if (mismatched_frame_count > 0) is_ok = false;
+    printf("present_mismatch_frames %d\n", mismatched_frame_count);
+    printf("checksum %08x\n", checksum);
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Builds the game natively against the stand-in host in tools/host_test.c and runs it headlessly.
+# Run from the root directory of the repository. Needs a C compiler for the host machine, not Clang's WASM target.
+#
+# Usage: tools/host_test.sh [base revision] [revision]
+#
+# Checks that:
+# * The rows presented always match the framebuffer, at every resolution.
+# * Every recorded session passes js_replay_verify, including when key events arrive 20 ms late.
+# * Every generated level can be solved. Prints how long each solve takes.
+#
+# Given a base git revision, the checks also run on it, and every frame it draws is compared with the
+# working tree's (or the second revision's), for opaque, binary and blended sprites at every resolution.
+# Revisions from before f64 timing (user-041) don't build.
+
+cc=${CC:-cc}
+base_revision=$1
+revision=$2
+failed=0
+
+mkdir -p build
+work_dir=$(mktemp -d)
+trap "rm -rf ${work_dir}" EXIT
+
+build_host() # <revision, or empty for the working tree> <output file>
+{
+    src_dir=src
+    if [ -n "$1" ]; then
+        mkdir -p ${work_dir}/$1
+        git archive "$1" src | tar -x -C ${work_dir}/$1 || exit 1
+        src_dir=${work_dir}/$1/src
+    fi
+    echo Building $2 from ${1:-the working tree}
+    ${cc} -O1 -std=gnu11 -I${src_dir} -o $2 tools/host_test.c ${src_dir}/squares.c ${src_dir}/shared.c || exit 1
+}
+
+# Runs a host and fails the test if it exits with an error.
+check() # <host> <description> <host arguments...>
+{
+    host=$1
+    description=$2
+    shift 2
+    if ${host} "$@" > ${work_dir}/output.txt; then
+        echo "PASS ${description}"
+    else
+        echo "FAIL ${description}"
+        grep -v "^verify 1" ${work_dir}/output.txt
+        failed=1
+    fi
+}
+
+run_checks() # <host>
+{
+    for resolution in 0 1 2; do
+        check $1 "presented rows at resolution ${resolution}" 3000 --resolution ${resolution}
+    done
+    check $1 "replays" 20000 --verify-replays
+    check $1 "replays with late input" 20000 --verify-replays --late-input-ms 20
+    check $1 "solver" 1600 --solve --level-size 1024x64 --level-density 1000
+    grep "^solve" ${work_dir}/output.txt
+}
+
+build_host "${revision}" build/host_test
+run_checks build/host_test
+
+if [ -n "${base_revision}" ]; then
+    build_host "${base_revision}" build/host_test_base
+    run_checks build/host_test_base
+
+    mkfifo ${work_dir}/frames
+    for alpha in opaque binary blended; do
+        for resolution in 0 1 2; do
+            arguments="3000 --resolution ${resolution} --alpha ${alpha}"
+            build/host_test_base ${arguments} --save-frames ${work_dir}/frames > /dev/null &
+            build/host_test ${arguments} --compare-frames ${work_dir}/frames > ${work_dir}/output.txt
+            wait
+            if grep -q "^compare_differing_frames 0 " ${work_dir}/output.txt; then
+                echo "SAME ${alpha} alpha at resolution ${resolution}"
+            else
+                echo "DIFFERENT ${alpha} alpha at resolution ${resolution}:" $(grep "^compare" ${work_dir}/output.txt)
+                failed=1
+            fi
+        done
+    done
+fi
+
+exit ${failed}